@@ -7,8 +7,12 @@
 #include "system_info.h"
 
 #include <wifi_station.h>
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
 #include <wifi_configuration_ap.h>
+#endif
+#if CONFIG_WIFI_CONNECT_SMARTCONFIG
 #include <wifi_smartconfig.h>
+#endif
 
 #define TAG "main"
 
@@ -32,6 +36,7 @@ extern "C" void app_main(void)
     wifi_station.Start();
     if (!wifi_station.IsConnected()) {
         std::string hint;
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
         if(wifi_cfg_type == SOFT_AP_WEB) {
             auto& wifi_ap = WifiConfigurationAp::GetInstance();
             wifi_ap.SetSsidPrefix("Xiaozhi");
@@ -42,13 +47,17 @@ extern "C" void app_main(void)
             hint += wifi_ap.GetWebServerUrl();
             ESP_LOGI(TAG,"%s",hint.c_str());
             wifi_ap.Start();
-        } else {
+        } else
+#endif
+        {
+#if CONFIG_WIFI_CONNECT_SMARTCONFIG
             auto& wifi_ap = WifiSmartConfiguration::GetInstance();
             // 显示 WiFi 配置 AP 的 SSID 和 Web 服务器 URL
             hint = "请关注微信小程序:(AI智能硬件)配网（“。”）";
             ESP_LOGI(TAG,"%s",hint.c_str());
             display->SetStatus(hint);
             wifi_ap.Start();
+#endif
         }
     }
     // Dump CPU usage every 10 second
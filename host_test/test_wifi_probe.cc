@@ -0,0 +1,142 @@
+// Probes against loopback stand-ins for the gateway and the TCP endpoint,
+// and the probe schedule against a fake clock
+#include "wifi_probe.h"
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// A TCP socket bound to an ephemeral loopback port, listening if asked
+static int BindLoopback(bool listening, uint16_t *port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0 || (listening && listen(sock, 1) != 0)) {
+        perror("loopback socket");
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return sock;
+}
+
+static void TestTcp()
+{
+    uint16_t port = 0;
+    int listener = BindLoopback(true, &port);
+    CHECK(listener >= 0);
+    CHECK(WifiProbe::Tcp(htonl(INADDR_LOOPBACK), port, 1000));
+    close(listener);
+
+    // Nothing listens on a bound but idle port: refused, the path is alive
+    int idle = BindLoopback(false, &port);
+    CHECK(idle >= 0);
+    CHECK(WifiProbe::Tcp(htonl(INADDR_LOOPBACK), port, 1000));
+    close(idle);
+
+    // A hung upstream: with its accept queue full the listener drops new
+    // SYNs, so the probe has to time out
+    int hung = BindLoopback(false, &port);
+    CHECK(hung >= 0 && listen(hung, 0) == 0);
+    int fillers[4];
+    for (int &filler : fillers) {
+        filler = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(filler, F_SETFL, O_NONBLOCK);
+        struct sockaddr_in to = {};
+        to.sin_family = AF_INET;
+        to.sin_port = htons(port);
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connect(filler, (struct sockaddr *)&to, sizeof(to));
+    }
+    usleep(100000);
+    CHECK(!WifiProbe::Tcp(htonl(INADDR_LOOPBACK), port, 300));
+    for (int filler : fillers) {
+        close(filler);
+    }
+    close(hung);
+}
+
+static void TestIcmp()
+{
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (sock < 0) {
+        printf("ICMP probe skipped, raw sockets need CAP_NET_RAW (errno %d)\n", errno);
+        return;
+    }
+    close(sock);
+    CHECK(WifiProbe::Icmp(htonl(INADDR_LOOPBACK), 1000));
+}
+
+static void TestSchedule()
+{
+    ProbeSchedule schedule(15000, 1000, 3, 60000);
+    int64_t now = 0;
+    CHECK(schedule.GetIntervalMs() == 15000);
+
+    // A miss drops to the short interval, a hit backs off towards the healthy one
+    CHECK(!schedule.OnProbe(false, now));
+    CHECK(schedule.GetIntervalMs() == 1000);
+    CHECK(!schedule.OnProbe(true, now));
+    CHECK(schedule.GetMisses() == 0);
+    CHECK(schedule.GetIntervalMs() == 2000);
+    for (int i = 0; i < 5; i++) {
+        schedule.OnProbe(true, now);
+    }
+    CHECK(schedule.GetIntervalMs() == 15000);
+
+    // max_misses in a row start a recovery
+    now = 1000000;
+    CHECK(!schedule.OnProbe(false, now));
+    now += 1000000;
+    CHECK(!schedule.OnProbe(false, now));
+    now += 1000000;
+    CHECK(schedule.OnProbe(false, now));
+    CHECK(schedule.IsRecovering());
+    CHECK(schedule.GetIntervalMs() == 15000);
+
+    // No IP for recovery_timeout_ms: recover again, once per timeout
+    CHECK(!schedule.OnRecoveryWait(now + 59999000));
+    CHECK(schedule.OnRecoveryWait(now + 60000000));
+    CHECK(!schedule.OnRecoveryWait(now + 60001000));
+    now += 60000000;
+
+    // The next IP ends it and reports both durations
+    uint32_t since_first_miss_ms = 0;
+    uint32_t since_recovery_ms = 0;
+    CHECK(schedule.OnGotIp(now + 500000, &since_first_miss_ms, &since_recovery_ms));
+    CHECK(since_first_miss_ms == 62500);
+    CHECK(since_recovery_ms == 500);
+    CHECK(!schedule.IsRecovering());
+    CHECK(schedule.GetMisses() == 0);
+    CHECK(!schedule.OnGotIp(now + 600000, &since_first_miss_ms, &since_recovery_ms));
+    CHECK(!schedule.OnRecoveryWait(now + 120000000));
+}
+
+int main()
+{
+    TestTcp();
+    TestIcmp();
+    TestSchedule();
+    if (failures != 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
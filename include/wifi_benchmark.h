@@ -0,0 +1,47 @@
+#ifndef _WIFI_BENCHMARK_H_
+#define _WIFI_BENCHMARK_H_
+
+#include <stdint.h>
+#include <sdkconfig.h>
+
+// Micro-benchmarks for the CPU-bound paths of this component: form decoding,
+// /scan serialisation, scan-to-credential matching, credential load/save and
+// PSK derivation. Each result is printed as one JSON object per line,
+// prefixed with "BENCH ", so a UART capture can be grepped and diffed.
+class WifiBenchmark {
+public:
+    // Runs every benchmark that is built in; the portal ones need
+    // CONFIG_WIFI_CONNECT_SOFTAP_PORTAL. The credential benchmarks use their
+    // own NVS namespace, which is erased afterwards; stored networks are not
+    // touched.
+    static void Run();
+
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
+    static void RunUrlDecode();
+    static void RunScanJson();
+#endif
+    static void RunMatch();
+    static void RunCredentialStore();
+    static void RunPskDerivation();
+    // Not part of Run(): needs a connected station and
+    // tools/throughput_server.py listening on host:port. Streams to the
+    // server, then from it, for the given seconds each, under the station's
+    // current link profile.
+    static void RunThroughput(const char *host, uint16_t port, int seconds);
+    // Not part of Run(): takes the WiFi driver, so nothing else may use it.
+    // Times STA to APSTA through a driver reinit, a restart and a mode switch.
+    static void RunRadioTransition();
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    // Not part of Run(): call on every boot once WifiStation::Start() has
+    // connected. Reports this boot's time to IP, then deep sleeps for
+    // sleep_ms, alternating wakes with and without the RTC state, until
+    // cycles wakes are done; the last one reports the averages and the
+    // time the fast path saves.
+    static void RunWakeToIp(int cycles, uint32_t sleep_ms);
+#endif
+
+private:
+    static void Report(const char *name, const char *variant, int iterations, int64_t elapsed_us);
+};
+
+#endif // _WIFI_BENCHMARK_H_
@@ -2,18 +2,84 @@
 #define _WIFI_CONFIGURATION_AP_H_
 
 #include <string>
+#include <vector>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_wifi.h>
 #include "esp_http_server.h"
 #include "esp_event.h"
+#include "wifi_credential_store.h"
+
+// Longest form fields of one network, every byte URL-encoded: "ssid=" and 32
+// bytes, "&password=" and 64, "&priority=255" and the '&' before the next one
+#define PORTAL_SUBMIT_NETWORK_BODY (5 + 32 * 3 + 10 + 64 * 3 + 13 + 1)
+// Largest /submit body accepted, enough for WIFI_CFG_MAX networks
+#define PORTAL_SUBMIT_MAX_BODY (WIFI_CFG_MAX * PORTAL_SUBMIT_NETWORK_BODY)
+// Task stacks grow with the credential table: recovery copies the whole
+// table onto its stack, a batch save keeps a PSK and an SSID per slot
+#define PORTAL_RECOVERY_STACK_SIZE (3584 + WIFI_CFG_MAX * sizeof(wifi_cfg))
+#define PORTAL_SUBMIT_STACK_SIZE (5760 + WIFI_CFG_MAX * 128)
+
+// Web server profile for the configuration portal. Phones open several
+// speculative connections each, so idle sockets are purged and reused.
+struct portal_server_cfg {
+    uint16_t max_open_sockets = 7;      // lwIP allows 10 sockets, httpd keeps 3 for itself
+    bool lru_purge_enable = true;       // close the least recently used socket when full
+    uint16_t recv_wait_timeout = 5;     // seconds
+    uint16_t send_wait_timeout = 5;     // seconds
+    bool keep_alive_enable = true;
+    int keep_alive_idle = 5;            // seconds
+    int keep_alive_interval = 5;        // seconds
+    int keep_alive_count = 3;
+    uint32_t scan_cache_ms = 10000;     // /scan results older than this are refreshed in the background
+};
+
+// While the portal runs, the idle STA interface periodically looks for the
+// stored networks so a device stranded by a router outage comes back online.
+struct portal_recovery_cfg {
+    bool enabled = true;
+    uint32_t interval_ms = 30000;       // first retry, doubled after every miss
+    uint32_t max_interval_ms = 300000;  // also used while a phone is on the portal
+};
+
+enum portal_submit_state {
+    PORTAL_SUBMIT_IDLE,
+    PORTAL_SUBMIT_TESTING,
+    PORTAL_SUBMIT_CONNECTED,
+    PORTAL_SUBMIT_FAILED,
+};
+
+// Outcome of one network of a /submit batch, reported on /status
+enum portal_network_result : uint8_t {
+    PORTAL_NETWORK_SAVED,
+    PORTAL_NETWORK_NOT_FOUND,       // not in the scan
+    PORTAL_NETWORK_BAD_PASSWORD,    // too short for the network's security
+    PORTAL_NETWORK_FAILED,          // connection test failed
+    PORTAL_NETWORK_NOT_SAVED,       // passed the scan, but no network of the batch connected
+};
 
 class WifiConfigurationAp {
 public:
     static WifiConfigurationAp& GetInstance();
     void SetSsidPrefix(const std::string &&ssid_prefix);
+    void SetServerConfig(const portal_server_cfg &config) { server_cfg_ = config; }
+    void SetRecoveryConfig(const portal_recovery_cfg &config) { recovery_cfg_ = config; }
     void Start();
 
     std::string GetSsid();
     std::string GetWebServerUrl();
 
+    // Serialise scan records as the JSON array served on /scan
+    static std::string ScanResultsToJson(const wifi_ap_record_t *ap_records, uint16_t ap_num);
+    static std::string UrlDecode(const std::string &url);
+    static std::string UrlEncode(const std::string &str);
+    // Parse a /submit body: one or more ssid/password pairs, each optionally
+    // followed by a priority (0 to 255). Without one, earlier networks rank
+    // higher. Returns false for malformed forms, an SSID given twice or more
+    // than WIFI_CFG_MAX networks.
+    static bool ParseSubmitForm(const std::string &body, std::vector<wifi_credential> &creds);
+
     // Delete copy constructor and assignment operator
     WifiConfigurationAp(const WifiConfigurationAp&) = delete;
     WifiConfigurationAp& operator=(const WifiConfigurationAp&) = delete;
@@ -24,15 +90,41 @@ private:
     ~WifiConfigurationAp();
 
     httpd_handle_t server_ = NULL;
+    portal_server_cfg server_cfg_;
+    portal_recovery_cfg recovery_cfg_;
+    std::atomic<int> ap_client_count_{0};
     EventGroupHandle_t event_group_;
+    // Guards scan_cache_, only held for reads and the swap after a scan
+    SemaphoreHandle_t scan_mutex_;
+    // Serialises the radio scans themselves
+    SemaphoreHandle_t scan_run_mutex_;
+    std::vector<wifi_ap_record_t> scan_cache_;
+    int64_t scan_cache_time_ = 0;
+    std::atomic<bool> scan_refreshing_{false};
+    std::atomic<bool> submit_busy_{false};
+    std::atomic<int> submit_state_{PORTAL_SUBMIT_IDLE};
+    // Written by the submit task before submit_state_ leaves TESTING
+    std::vector<std::pair<std::string, portal_network_result>> submit_results_;
+    uint8_t ap_channel_ = 0;
     std::string ssid_prefix_;
-    esp_event_handler_instance_t instance_any_id_;
-    esp_event_handler_instance_t instance_got_ip_;
     void StartAccessPoint();
     void StartWebServer();
     bool ConnectToWifi(const std::string &ssid, const std::string &password);
-    void Save(const std::string &ssid, const std::string &password);
-    static std::string UrlDecode(const std::string &url);
+    void AbortConnect();
+    void SubmitBatch(std::vector<wifi_credential> &creds);
+    void HandOverBatch(std::vector<wifi_credential> &creds);
+    std::string GetScanJson();
+    bool ScanCacheFreshLocked();
+    bool RefreshScan();
+    bool Scan();
+    uint8_t ChooseApChannel();
+    uint8_t FindChannel(const std::string &ssid);
+    void MoveApChannel(uint8_t channel);
+    bool TryRecoverStation();
+    static void ScheduleRestart();
+    static void SubmitTask(void *arg);
+    static void ScanTask(void *arg);
+    static void RecoveryTask(void *arg);
 
     // Event handlers
     static void WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
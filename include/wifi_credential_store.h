@@ -0,0 +1,88 @@
+#ifndef _WIFI_CREDENTIAL_STORE_H_
+#define _WIFI_CREDENTIAL_STORE_H_
+
+#include <string>
+#include <stdint.h>
+#include <esp_wifi.h>
+#include <nvs.h>
+#include <sdkconfig.h>
+
+#ifdef CONFIG_WIFI_CONNECT_CFG_MAX
+#define WIFI_CFG_MAX CONFIG_WIFI_CONNECT_CFG_MAX
+#else
+#define WIFI_CFG_MAX 3
+#endif
+// A WPA2 PSK is stored as 64 hex digits, which the driver accepts in place of a passphrase
+#define WIFI_PSK_HEX_LEN 64
+
+struct batch_entry;
+
+struct wifi_cfg{
+    uint8_t flag;
+    uint8_t channel;    // channel the network was last connected on, 0 if unknown
+    uint8_t priority;   // higher is preferred over a stronger signal, 0 by default
+    int32_t connect_cnt;
+    char psk[WIFI_PSK_HEX_LEN + 1];   // precomputed WPA2 PSK, empty if none
+    wifi_config_t cfg;
+};
+
+// One network of a batch save
+struct wifi_credential {
+    std::string ssid;
+    std::string password;
+    uint8_t priority;
+    std::string psk;    // precomputed PSK, derived by the store if empty
+};
+
+class WifiCredentialStore {
+public:
+    // The store used by the station and the provisioning paths ("wifi" namespace)
+    static WifiCredentialStore& GetInstance();
+    explicit WifiCredentialStore(const char *nvs_namespace);
+    ~WifiCredentialStore() = default;
+
+    // Read `count` slots into cfgs, creating the flag/counter keys of empty slots.
+    // Returns true if at least one network is stored.
+    bool Load(wifi_cfg *cfgs, int count);
+    // Read a single slot. Returns true if it holds a network.
+    bool Load(int num, wifi_cfg *cfg);
+    // Slot of a stored SSID, or -1
+    int Find(const std::string &ssid);
+    // Save a network into its existing slot, a free slot or the least used slot.
+    // The PSK is derived here so the station never has to run PBKDF2 on connect.
+    // Returns the slot number.
+    int Save(const std::string &ssid, const std::string &password, uint8_t priority = 0);
+    // Save up to WIFI_CFG_MAX networks as one unit: the batch is journaled in
+    // a single NVS key before any slot is touched, and a reset part way
+    // through is finished the next time the store is opened. Slots are picked
+    // as for Save(), never twice in one batch, and returned through slots if
+    // given (-1 if no slot was left). keep_slot is never evicted for another
+    // SSID. Returns the number saved.
+    int SaveBatch(const wifi_credential *creds, int count, int *slots = nullptr, int keep_slot = -1);
+    // Incremental updates that only write the keys of one slot
+    bool SetPriority(int num, uint8_t priority);
+    bool Remove(int num);
+
+    // PBKDF2-SHA1(passphrase, ssid, 4096) as 64 hex digits. Returns false for
+    // passphrases that have no PSK form (open networks, already hex PSKs).
+    static bool DerivePsk(const std::string &ssid, const std::string &password, char psk[WIFI_PSK_HEX_LEN + 1]);
+    // Average PSK derivation time in microseconds over the given rounds
+    static int64_t BenchmarkDerivePsk(const std::string &ssid, const std::string &password, int rounds);
+    // Passphrases fit the driver's 64-byte field with room for the terminator,
+    // so at most 63 characters. Exactly 64 is only taken as a hex PSK.
+    static bool IsValidPassword(const std::string &password);
+
+    // Delete copy constructor and assignment operator
+    WifiCredentialStore(const WifiCredentialStore&) = delete;
+    WifiCredentialStore& operator=(const WifiCredentialStore&) = delete;
+
+private:
+    std::string nvs_namespace_;
+    bool LoadSlot(nvs_handle_t nvs_handle, int num, wifi_cfg *cfg);
+    void SlotChanged(int num);
+    void WriteSlot(nvs_handle_t nvs_handle, const batch_entry &entry);
+    void ReplayJournal(nvs_handle_t nvs_handle);
+    bool journal_checked_ = false;
+};
+
+#endif // _WIFI_CREDENTIAL_STORE_H_
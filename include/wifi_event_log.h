@@ -0,0 +1,64 @@
+#ifndef _WIFI_EVENT_LOG_H_
+#define _WIFI_EVENT_LOG_H_
+
+#include <stdint.h>
+#include <sdkconfig.h>
+
+// Number of records kept in RAM, 0 compiles the event log out entirely
+#ifndef WIFI_EVENT_LOG_SIZE
+#ifdef CONFIG_WIFI_CONNECT_EVENT_LOG_SIZE
+#define WIFI_EVENT_LOG_SIZE CONFIG_WIFI_CONNECT_EVENT_LOG_SIZE
+#else
+#define WIFI_EVENT_LOG_SIZE 64
+#endif
+#endif
+
+enum wifi_log_event : uint16_t {
+    WIFI_LOG_SCAN_START = 1,    // arg0 channel (0 = all)
+    WIFI_LOG_SCAN_DONE,         // arg0 ap count
+    WIFI_LOG_SCAN_AP,           // arg0 rssi, arg1 ssid hash, arg2 channel << 8 | authmode
+    WIFI_LOG_MATCH,             // arg0 slot, arg1 ssid hash, arg2 rssi
+    WIFI_LOG_CONNECT,           // arg0 slot, arg1 ssid hash, arg2 channel << 8 | psk used
+    WIFI_LOG_SCAN_TIME,         // arg1 scan time in ms
+    WIFI_LOG_DISCONNECTED,      // arg0 reason, arg1 attempt
+    WIFI_LOG_GOT_IP,            // arg1 ip address
+    WIFI_LOG_PORTAL_SCAN,       // arg0 ap count, arg1 1 if the cache was fresh
+    WIFI_LOG_PORTAL_SUBMIT,     // arg0 network count, arg1 ssid hash of the first
+    WIFI_LOG_CONNECT_TEST,      // arg0 1 on success, arg1 ssid hash, arg2 duration in ms
+    WIFI_LOG_SAVE,              // arg0 slot, arg1 ssid hash, arg2 priority
+    WIFI_LOG_PROBE_MISS,        // arg0 consecutive misses
+    WIFI_LOG_RECOVERED,         // arg0 misses, arg1 ms since first miss, arg2 ms since recovery started
+    WIFI_LOG_REMOVE,            // arg0 slot
+    WIFI_LOG_SWITCH,            // arg0 slot, arg1 ssid hash
+    WIFI_LOG_RADIO_MODE,        // arg0 old mode << 4 | new mode, arg1 transition time in us
+    WIFI_LOG_WAKE_TO_IP,        // arg0 1 if rejoined from RTC state, arg1 ms since boot
+    WIFI_LOG_FAST_WAKE_FAILED,  // arg0 disconnect reason
+};
+
+// One fixed-size record, written without any formatting. SSIDs are kept as
+// FNV-1a hashes and secrets are never recorded.
+struct wifi_log_record {
+    uint32_t time_us;   // low 32 bits of esp_timer_get_time()
+    uint16_t event;
+    int16_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+};
+
+class WifiEventLog {
+public:
+    static void Write(uint16_t event, int16_t arg0, uint32_t arg1, uint32_t arg2);
+    // Copy up to max records, oldest first. Returns the number copied.
+    static int Read(wifi_log_record *records, int max);
+    // Decode the buffered records to the console
+    static void Dump();
+    static uint32_t HashSsid(const void *ssid);
+};
+
+#if WIFI_EVENT_LOG_SIZE > 0
+#define WIFI_EVENT_LOG(event, arg0, arg1, arg2) WifiEventLog::Write((event), (arg0), (arg1), (arg2))
+#else
+#define WIFI_EVENT_LOG(event, arg0, arg1, arg2) do { } while (0)
+#endif
+
+#endif // _WIFI_EVENT_LOG_H_
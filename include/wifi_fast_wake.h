@@ -0,0 +1,54 @@
+#ifndef _WIFI_FAST_WAKE_H_
+#define _WIFI_FAST_WAKE_H_
+
+#include <stdint.h>
+#include <sdkconfig.h>
+#include "wifi_credential_store.h"
+
+// Bump when wifi_wake_state changes layout, so an image update never reads
+// the previous firmware's RTC memory as valid
+#define WIFI_WAKE_STATE_VERSION 1
+
+// Reuse a DHCP lease for at most this long after it was obtained
+#ifdef CONFIG_WIFI_CONNECT_FAST_WAKE_LEASE_AGE
+#define WIFI_WAKE_LEASE_AGE_S CONFIG_WIFI_CONNECT_FAST_WAKE_LEASE_AGE
+#else
+#define WIFI_WAKE_LEASE_AGE_S 3600
+#endif
+
+// Everything the station needs to rejoin the last network straight after a
+// deep sleep wake: no NVS, no scan, no DHCP
+struct wifi_wake_state {
+    uint32_t version;
+    uint8_t slot;               // credential store slot the network lives in
+    uint8_t channel;
+    uint8_t authmode;           // wifi_auth_mode_t seen when connecting
+    uint8_t priority;
+    uint8_t bssid[6];
+    char ssid[33];
+    char password[65];
+    char psk[WIFI_PSK_HEX_LEN + 1];
+    uint32_t ip;                // network byte order
+    uint32_t netmask;
+    uint32_t gateway;
+    uint32_t dns;
+    int64_t lease_time_us;      // wall clock when DHCP handed out ip
+    uint32_t crc;               // CRC32 of everything above
+};
+
+// Keeps one wifi_wake_state in RTC slow memory, which survives deep sleep
+// but not a power cycle. The state is checked against its CRC and the lease
+// age before it is handed out.
+class WifiFastWake {
+public:
+    // Copy of the retained state, false if there is none, it is corrupt or
+    // the lease is too old
+    static bool Load(wifi_wake_state *state);
+    static void Save(const wifi_wake_state &state);
+    // Forces the next wake through NVS, scan and DHCP
+    static void Invalidate();
+    // Same, only if the state was taken from this credential store slot
+    static void InvalidateSlot(int slot);
+};
+
+#endif // _WIFI_FAST_WAKE_H_
@@ -0,0 +1,50 @@
+#ifndef _WIFI_PROBE_H_
+#define _WIFI_PROBE_H_
+
+#include <stdint.h>
+
+// Upstream probes and the supervisor's probe schedule. Only BSD sockets and
+// the C library are used, lwIP on the device and the kernel's on a host, so
+// this builds and runs in host_test/ as well.
+class WifiProbe {
+public:
+    // One probe each. Addresses are in network byte order.
+    static bool Icmp(uint32_t addr, uint32_t timeout_ms);
+    // A refused connection still proves the path is alive
+    static bool Tcp(uint32_t addr, uint16_t port, uint32_t timeout_ms);
+};
+
+// Decides when to probe and when to recover, without any clock of its own:
+// every call is given the current time in microseconds.
+class ProbeSchedule {
+public:
+    ProbeSchedule(uint32_t interval_ms, uint32_t min_interval_ms, int max_misses, uint32_t recovery_timeout_ms);
+
+    // How long to wait for a link event before the next probe
+    uint32_t GetIntervalMs() const { return interval_ms_; }
+    int GetMisses() const { return misses_; }
+    // A recovery was started and the link has no IP yet
+    bool IsRecovering() const { return recovering_; }
+
+    // Result of a probe. Returns true if the link should be recovered now.
+    bool OnProbe(bool ok, int64_t now_us);
+    // The link got an IP. Returns true if that ended a recovery, with the
+    // time since the first missed probe and since the last reassociation.
+    bool OnGotIp(int64_t now_us, uint32_t *since_first_miss_ms, uint32_t *since_recovery_ms);
+    // While recovering without an IP: true if the recovery timed out and
+    // should be started again
+    bool OnRecoveryWait(int64_t now_us);
+
+private:
+    uint32_t healthy_interval_ms_;
+    uint32_t min_interval_ms_;
+    int max_misses_;
+    uint32_t recovery_timeout_ms_;
+    uint32_t interval_ms_;
+    int misses_ = 0;
+    bool recovering_ = false;
+    int64_t first_miss_us_ = 0;
+    int64_t recovery_start_us_ = 0;
+};
+
+#endif // _WIFI_PROBE_H_
@@ -0,0 +1,85 @@
+#ifndef _WIFI_RADIO_H_
+#define _WIFI_RADIO_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_wifi.h>
+#include <esp_netif.h>
+#include "esp_event.h"
+
+// Station, portal and SmartConfig at the same time, plus one spare
+#define WIFI_RADIO_USER_MAX 4
+#define WIFI_RADIO_HANDLER_MAX 10
+
+// Single owner of the WiFi driver, the default netifs and the event handler
+// registrations of this component. Users take a reference for the interfaces
+// they need and the driver runs in the union of those modes, so going from
+// station to portal is a mode switch on a running stack instead of a full
+// deinit and init. Netifs are created once and kept.
+class WifiRadio {
+public:
+    static WifiRadio& GetInstance();
+
+    // Take (or change) owner's reference. The first reference initialises
+    // netif and the driver, with init_cfg if given; later ones only switch
+    // the mode. Returns ESP_ERR_NO_MEM if the user table is full.
+    esp_err_t Acquire(void *owner, wifi_mode_t mode, const wifi_init_config_t *init_cfg = nullptr);
+    // Drop owner's reference and unregister its handlers. The driver is
+    // stopped, but stays initialised, once no reference is left.
+    void Release(void *owner);
+    // Deinitialise the stopped driver to get its buffers back
+    void Deinit();
+
+    // Registered with owner as the handler argument, unregistered by Release().
+    // A handler the owner already has for base and id is left as it is.
+    esp_err_t RegisterHandler(void *owner, esp_event_base_t base, int32_t id, esp_event_handler_t handler);
+
+    // Scans and connects on the STA interface are driven by one user at a
+    // time. The station holds it while it runs, the portal only around a
+    // scan or a connection test. True if owner holds it now.
+    bool ClaimSta(void *owner);
+    void YieldSta(void *owner);
+    // Event handlers of anyone else leave STA events alone
+    void *GetStaOwner() const { return sta_owner_.load(); }
+
+    wifi_mode_t GetMode() const { return mode_; }
+    bool IsInitialized() const { return initialized_; }
+    esp_netif_t *GetStaNetif() const { return sta_netif_; }
+    esp_netif_t *GetApNetif() const { return ap_netif_; }
+    // Duration of the last mode change, init and start included
+    int64_t GetLastTransitionUs() const { return transition_us_; }
+
+    // Delete copy constructor and assignment operator
+    WifiRadio(const WifiRadio&) = delete;
+    WifiRadio& operator=(const WifiRadio&) = delete;
+
+private:
+    WifiRadio();
+    ~WifiRadio();
+
+    struct user {
+        void *owner;
+        wifi_mode_t mode;
+    };
+    struct handler {
+        void *owner;
+        esp_event_base_t base;
+        int32_t id;
+        esp_event_handler_instance_t instance;
+    };
+    SemaphoreHandle_t mutex_;
+    user users_[WIFI_RADIO_USER_MAX] = {};
+    handler handlers_[WIFI_RADIO_HANDLER_MAX] = {};
+    wifi_mode_t mode_ = WIFI_MODE_NULL;
+    bool netif_initialized_ = false;
+    bool initialized_ = false;
+    esp_netif_t *sta_netif_ = nullptr;
+    esp_netif_t *ap_netif_ = nullptr;
+    int64_t transition_us_ = 0;
+    std::atomic<void *> sta_owner_{nullptr};
+    void ApplyLocked(const wifi_init_config_t *init_cfg);
+};
+
+#endif // _WIFI_RADIO_H_
@@ -18,7 +18,7 @@ private:
     ~WifiSmartConfiguration();
     std::string ssid_;
     std::string password_;
-    int reconnect_count_;
+    int reconnect_count_ = 0;
     EventGroupHandle_t event_group_;
     void Save(const std::string &ssid, const std::string &password);
 
@@ -2,30 +2,159 @@
 #define _WIFI_STATION_H_
 
 #include <string>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <esp_wifi.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
 #include "esp_event.h"
+#include "wifi_credential_store.h"
+#include "wifi_fast_wake.h"
 
-#define WIFI_CFG_MAX 3
+// Highest 2.4 GHz channel that the incremental scan will visit
+#define WIFI_SCAN_CHANNEL_MAX 13
+// A stored network seen at or above this RSSI ends the incremental scan early
+#define WIFI_SCAN_GOOD_RSSI -75
+// Size of the connectivity listener table
+#define WIFI_LISTENER_MAX 8
+// Size of one driver RX buffer, used for the link profile RAM estimate
+#define WIFI_RX_BUFFER_BYTES 1600
 
-struct wifi_cfg{
-    uint8_t flag;
-    int32_t connect_cnt;
-    wifi_config_t cfg;
+enum wifi_link_state : uint8_t {
+    WIFI_LINK_IDLE,
+    WIFI_LINK_SCANNING,
+    WIFI_LINK_CONNECTING,
+    WIFI_LINK_ASSOCIATED,   // associated, waiting for an address
+    WIFI_LINK_CONNECTED,    // associated and has an IP address
+    WIFI_LINK_DISCONNECTED,
 };
 
+// Connection status as one fixed-size value. It is published with a seqlock,
+// so any task can take a consistent copy without locks or heap allocation.
+struct wifi_status {
+    uint32_t generation;    // bumped on every update
+    uint8_t state;          // wifi_link_state
+    uint8_t channel;
+    int8_t rssi;
+    uint8_t bssid[6];
+    char ssid[33];
+    uint32_t ip;            // network byte order, 0 without an address
+    uint32_t gateway;
+};
+
+enum wifi_link_event_id : uint8_t {
+    WIFI_LINK_EVENT_CONNECTED,      // associated to an AP
+    WIFI_LINK_EVENT_GOT_IP,
+    WIFI_LINK_EVENT_LOST_IP,
+    WIFI_LINK_EVENT_ROAMED,         // associated to another BSSID of the same network
+    WIFI_LINK_EVENT_DISCONNECTED,   // reason holds the wifi_err_reason_t
+};
+
+struct wifi_link_event {
+    uint8_t id;             // wifi_link_event_id
+    uint8_t reason;
+    wifi_status status;     // snapshot taken right after the change
+};
+
+enum wifi_link_profile : uint8_t {
+    WIFI_PROFILE_LOW_MEMORY,        // sensors: HT20, no aggregation, few RX buffers, lower TX power
+    WIFI_PROFILE_BALANCED,          // the ESP-IDF defaults
+    WIFI_PROFILE_HIGH_THROUGHPUT,   // streaming: HT40 where supported, aggregation, deep RX buffering
+};
+
+// Radio settings applied by WifiStation::Start(). Buffer counts and
+// aggregation are part of wifi_init_config_t, so they only take effect if the
+// station is the first user of the WiFi driver (see WifiRadio).
+struct wifi_link_profile_cfg {
+    wifi_bandwidth_t bandwidth;     // WIFI_BW_HT20 or WIFI_BW_HT40
+    uint8_t protocol;               // WIFI_PROTOCOL_* mask
+    bool ampdu_tx;
+    bool ampdu_rx;
+    uint8_t rx_ba_win;              // AMPDU RX reorder window, at most dynamic_rx_buf and 2 * static_rx_buf
+    uint8_t static_rx_buf;
+    uint8_t dynamic_rx_buf;
+    int8_t max_tx_power;            // 0.25 dBm units, 8 to 84
+};
+
+// Called from the default event loop task, keep it short and non-blocking
+typedef void (*wifi_link_callback_t)(const wifi_link_event &event, void *arg);
+
 class WifiStation {
 public:
     static WifiStation& GetInstance();
+    // Same as AddNetwork() with priority 0
     void SetAuth(const std::string &&ssid, const std::string &&password);
     void Start();
     bool IsConnected();
     int8_t GetRssi();
-    std::string GetSsid() const { return ssid_; }
-    std::string GetIpAddress() const { return ip_address_; }
+    // Consistent snapshot of the connection, safe to call from any task
+    wifi_status GetStatus() const;
+    std::string GetSsid() const;
+    std::string GetIpAddress() const;
+    // Get told about connectivity changes instead of polling IsConnected().
+    // Queue listeners receive wifi_link_event items and drop events when full.
+    // Returns a handle for Unsubscribe(), or -1 if the table is full.
+    // Unsubscribe() returns once no event is being delivered, so the queue or
+    // arg may be freed right after; from inside a callback it returns at once.
+    int Subscribe(wifi_link_callback_t callback, void *arg);
+    int Subscribe(QueueHandle_t queue);
+    void Unsubscribe(int handle);
+    // Change the stored networks at runtime, from any task. The in-memory
+    // table and only the touched NVS keys are updated; the WiFi driver and
+    // netif are left running. New passwords and priorities apply from the next
+    // connect. AddNetwork() updates an SSID that is already stored and
+    // returns its slot, or -1. With the table full it replaces the least used
+    // network, never the one the station is connected to. With
+    // CONFIG_WIFI_CONNECT_CFG_MAX=1 it replaces that one and switches over.
+    // Passwords are up to 63 characters, or 64 hex digits for a raw PSK.
+    int AddNetwork(const std::string &ssid, const std::string &password, uint8_t priority = 0);
+    bool SetNetworkPriority(const std::string &ssid, uint8_t priority);
+    // Removing the current network fails over to another stored one
+    bool RemoveNetwork(const std::string &ssid);
+    // Leave the current network for a stored one, falls back to the usual
+    // selection if it is not in range. A station that gave up scans again.
+    // Returns false before Start().
+    bool SwitchNetwork(const std::string &ssid);
+    // Copy of the table, returns the number of stored networks
+    int GetNetworks(wifi_cfg cfgs[WIFI_CFG_MAX]);
+    // Drop the current association and connect again. With failover the
+    // next scan skips the current network if another stored one is in range.
+    // A station that gave up after Start() had connected scans again.
+    void Reassociate(bool failover);
     uint8_t GetChannel();
     void SaveConfig(int num, bool status);
     uint8_t ReadConfig();
     void SetPowerSaveMode(bool enabled);
+    // Find the AP in ap_records of the highest priority network stored in
+    // cfgs, the strongest one between networks of equal priority.
+    // Returns the index into cfgs, or -1, and the AP index through ap_index.
+    static int FindBestMatch(const wifi_cfg *cfgs, int cfg_count, const wifi_ap_record_t *ap_records, uint16_t ap_count, int *ap_index);
+    // Scan channel by channel (last seen channels, then 1/6/11, then the rest)
+    // and stop as soon as a stored network is found. Enabled by default.
+    void SetIncrementalScan(bool enabled) { incremental_scan_ = enabled; }
+    // Time spent scanning before the last connect attempt, in milliseconds
+    uint32_t GetScanTimeMs() const { return scan_time_us_ / 1000; }
+    // Connect to WPA/WPA2-PSK networks with the stored PSK instead of the
+    // passphrase, so the driver skips PBKDF2. WPA3 always uses the passphrase.
+    void SetPmkCache(bool enabled) { pmk_cache_ = enabled; }
+    // Protected Management Frames for WPA2/WPA3 networks
+    void SetPmf(bool capable, bool required) { pmf_capable_ = capable; pmf_required_ = required; }
+    // Trade memory for throughput. Call before Start(); defaults to balanced.
+    void SetLinkProfile(wifi_link_profile profile) { link_profile_ = GetLinkProfile(profile); }
+    void SetLinkProfile(const wifi_link_profile_cfg &profile) { link_profile_ = profile; }
+    const wifi_link_profile_cfg &GetLinkProfile() const { return link_profile_; }
+    static const wifi_link_profile_cfg &GetLinkProfile(wifi_link_profile profile);
+    // Worst-case bytes of RX buffering a profile needs: static buffers are
+    // allocated at init, dynamic ones as traffic arrives
+    static uint32_t EstimateRam(const wifi_link_profile_cfg &profile);
+    // True while the link is the one rejoined from the state kept in RTC
+    // memory over deep sleep (CONFIG_WIFI_CONNECT_FAST_WAKE) instead of NVS,
+    // scan and DHCP. Cleared at its first disconnect.
+    bool IsFastWake() const { return fast_wake_; }
+    // Time from boot to the first IP address, 0 until there is one
+    uint32_t GetWakeToIpMs() const { return wake_to_ip_us_ / 1000; }
 
 private:
     WifiStation();
@@ -34,14 +163,75 @@ private:
     WifiStation& operator=(const WifiStation&) = delete;
 
     EventGroupHandle_t event_group_;
-    std::string ssid_;
-    std::string password_;
-    std::string ip_address_;
+    // Guards wifi_cfg_ between the event loop task and the runtime credential API
+    SemaphoreHandle_t cfg_mutex_;
+    // Seqlock: odd while an update is being written
+    std::atomic<uint32_t> status_seq_{0};
+    std::atomic<uint32_t> status_words_[(sizeof(wifi_status) + 3) / 4];
+    wifi_status status_ = {};   // writer side copy, guarded by status_lock_
+    portMUX_TYPE status_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    struct listener {
+        wifi_link_callback_t callback;
+        void *arg;
+        QueueHandle_t queue;
+    };
+    listener listeners_[WIFI_LISTENER_MAX] = {};
+    portMUX_TYPE listeners_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    // Task running Notify()'s callouts, nullptr when idle
+    TaskHandle_t notify_task_ = nullptr;
     int reconnect_count_ = 0;
     int scan_try_count_ = 0;
     int wifi_num_ = 0;
     bool has_wifi_cfg_ = false;
-    wifi_cfg wifi_cfg_[WIFI_CFG_MAX];
+    // Start() connected and the radio is still ours
+    bool started_ = false;
+    // False while only the fast wake slot has been filled in
+    bool table_loaded_ = false;
+    wifi_cfg wifi_cfg_[WIFI_CFG_MAX] = {};
+    bool incremental_scan_ = true;
+    uint8_t scan_channels_[WIFI_SCAN_CHANNEL_MAX];
+    int scan_channel_count_ = 0;
+    int scan_channel_index_ = 0;
+    int64_t scan_start_time_ = 0;
+    int64_t scan_time_us_ = 0;
+    int candidate_num_ = -1;
+    int exclude_num_ = -1;
+    int target_num_ = -1;
+    std::atomic<int> reassociate_request_{0};
+    std::atomic<int> switch_num_{-1};
+    esp_timer_handle_t scan_retry_timer_ = nullptr;
+    std::atomic<bool> scan_retry_{false};
+    int8_t candidate_rssi_ = 0;
+    uint8_t candidate_channel_ = 0;
+    wifi_auth_mode_t candidate_authmode_ = WIFI_AUTH_OPEN;
+    const uint8_t *candidate_bssid_ = nullptr;
+    bool fast_wake_ = false;
+    wifi_wake_state wake_state_ = {};
+    int64_t wake_to_ip_us_ = 0;
+    bool pmk_cache_ = true;
+    bool pmf_capable_ = true;
+    bool pmf_required_ = false;
+    wifi_link_profile_cfg link_profile_ = GetLinkProfile(WIFI_PROFILE_BALANCED);
+    void OnStaStart();
+    bool RescanIfGaveUp(int exclude_num, int target_num);
+    bool SwitchToSlot(int num);
+    void ApplyLinkProfile();
+    void LoadTable();
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    void ConnectFast();
+    void LeaveFastWake();
+    void EndFastWake();
+    void SaveWakeState(const esp_netif_ip_info_t &ip_info);
+#endif
+    void BuildScanChannels();
+    void StartScan();
+    void ScheduleScanRetry();
+    void RetryScan();
+    bool MatchScanRecords(const wifi_ap_record_t *ap_records, uint16_t ap_count);
+    void ConnectToCandidate();
+    template <typename F> void UpdateStatus(F update);
+    int AddListener(const listener &entry);
+    void Notify(wifi_link_event_id id, uint8_t reason = 0);
     static void WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
     static void IpEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 };
@@ -0,0 +1,58 @@
+#ifndef _WIFI_SUPERVISOR_H_
+#define _WIFI_SUPERVISOR_H_
+
+#include <string>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+struct supervisor_cfg {
+    bool probe_gateway = true;          // ICMP echo to the DHCP gateway
+    std::string tcp_host;               // optional IPv4 address to connect to, empty to skip
+    uint16_t tcp_port = 0;
+    uint32_t interval_ms = 15000;       // probe interval while the link is healthy
+    uint32_t min_interval_ms = 1000;    // probe interval right after a miss
+    uint32_t timeout_ms = 1000;         // per probe
+    int max_misses = 3;                 // consecutive misses before recovery
+    uint32_t recovery_timeout_ms = 60000;   // no IP this long after a reassociation: force another
+    bool failover = true;               // try another stored network on recovery
+};
+
+// Watches the upstream of an associated link. A device stuck on an AP whose
+// uplink or DHCP server hung keeps IP_EVENT_STA_GOT_IP forever; the
+// supervisor notices the dead link by probing and forces a reassociation.
+class WifiSupervisor {
+public:
+    static WifiSupervisor& GetInstance();
+    void Start(const supervisor_cfg &config);
+    // Returns once the supervisor task has exited
+    void Stop();
+
+    // Time from the first missed probe to the next IP of the last recovery
+    uint32_t GetLastRecoveryMs() const { return last_recovery_ms_; }
+    int GetRecoveryCount() const { return recovery_count_; }
+
+    // Delete copy constructor and assignment operator
+    WifiSupervisor(const WifiSupervisor&) = delete;
+    WifiSupervisor& operator=(const WifiSupervisor&) = delete;
+
+private:
+    WifiSupervisor() = default;
+    ~WifiSupervisor() = default;
+
+    supervisor_cfg config_;
+    TaskHandle_t task_ = nullptr;
+    QueueHandle_t events_ = nullptr;
+    SemaphoreHandle_t exited_ = nullptr;
+    int listener_ = -1;
+    volatile bool running_ = false;
+    uint32_t last_recovery_ms_ = 0;
+    int recovery_count_ = 0;
+
+    bool Probe();
+    static void SupervisorTask(void *arg);
+};
+
+#endif // _WIFI_SUPERVISOR_H_
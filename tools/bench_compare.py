@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Compare two WifiBenchmark captures.
+
+Capture the UART output of WifiBenchmark::Run() before and after a change,
+then run:
+
+    python3 tools/bench_compare.py before.log after.log
+
+Only lines starting with "BENCH " are read. Cases that got slower than
+--threshold percent are flagged and make the script exit with status 1.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    results = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            index = line.find("BENCH {")
+            if index < 0:
+                continue
+            entry = json.loads(line[index + len("BENCH "):])
+            results[(entry["name"], entry["variant"])] = entry["ns_per_op"]
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument("--threshold", type=float, default=10.0, help="percent slowdown to flag")
+    args = parser.parse_args()
+
+    before = load(args.before)
+    after = load(args.after)
+    regressed = False
+    for key in sorted(set(before) | set(after)):
+        old = before.get(key)
+        new = after.get(key)
+        name = "%s[%s]" % key
+        if old is None or new is None:
+            print("%-40s %12s -> %12s" % (name, old, new))
+            continue
+        change = (new - old) * 100.0 / old if old else 0.0
+        flag = ""
+        if change > args.threshold:
+            flag = "  REGRESSION"
+            regressed = True
+        print("%-40s %12d -> %12d ns/op %+7.1f%%%s" % (name, old, new, change, flag))
+    sys.exit(1 if regressed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Load generator for the WiFi configuration portal.
+
+Join the device SoftAP from the host, then run for example:
+
+    python3 tools/portal_load_test.py --clients 4 --duration 30
+
+Each client keeps a connection open and alternates between the paths given
+with --path, the way a phone polls the portal page. Latency percentiles are
+printed per path, --json prints them in machine-readable form instead.
+"""
+
+import argparse
+import http.client
+import json
+import threading
+import time
+
+
+def percentile(values, pct):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    index = min(len(values) - 1, int(round(pct / 100.0 * (len(values) - 1))))
+    return values[index]
+
+
+def client_loop(host, port, paths, deadline, timeout, results, lock):
+    conn = None
+    i = 0
+    while time.monotonic() < deadline:
+        path = paths[i % len(paths)]
+        i += 1
+        start = time.monotonic()
+        try:
+            if conn is None:
+                conn = http.client.HTTPConnection(host, port, timeout=timeout)
+            conn.request("GET", path)
+            response = conn.getresponse()
+            response.read()
+            ok = response.status == 200
+            if response.getheader("Connection", "").lower() == "close":
+                conn.close()
+                conn = None
+        except (OSError, http.client.HTTPException):
+            ok = False
+            if conn is not None:
+                conn.close()
+            conn = None
+        elapsed_ms = (time.monotonic() - start) * 1000.0
+        with lock:
+            entry = results.setdefault(path, {"latency_ms": [], "errors": 0})
+            if ok:
+                entry["latency_ms"].append(elapsed_ms)
+            else:
+                entry["errors"] += 1
+    if conn is not None:
+        conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--clients", type=int, default=4, help="number of concurrent clients")
+    parser.add_argument("--duration", type=float, default=30.0, help="seconds to run")
+    parser.add_argument("--timeout", type=float, default=10.0, help="per request timeout in seconds")
+    parser.add_argument("--path", action="append", help="path to request, may be repeated (default: / and /scan)")
+    parser.add_argument("--json", action="store_true", help="print results as JSON")
+    args = parser.parse_args()
+
+    paths = args.path or ["/", "/scan"]
+    results = {}
+    lock = threading.Lock()
+    deadline = time.monotonic() + args.duration
+    threads = [
+        threading.Thread(target=client_loop,
+                         args=(args.host, args.port, paths, deadline, args.timeout, results, lock))
+        for _ in range(args.clients)
+    ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    report = {"clients": args.clients, "duration_s": args.duration, "paths": {}}
+    for path, entry in sorted(results.items()):
+        latency = entry["latency_ms"]
+        report["paths"][path] = {
+            "requests": len(latency),
+            "errors": entry["errors"],
+            "p50_ms": round(percentile(latency, 50), 1),
+            "p99_ms": round(percentile(latency, 99), 1),
+            "max_ms": round(max(latency), 1) if latency else 0.0,
+        }
+
+    if args.json:
+        print(json.dumps(report, indent=2))
+        return
+    print("%d clients, %.0f s" % (args.clients, args.duration))
+    for path, stats in report["paths"].items():
+        print("%-10s requests=%-6d errors=%-4d p50=%7.1f ms  p99=%7.1f ms  max=%7.1f ms" % (
+            path, stats["requests"], stats["errors"], stats["p50_ms"], stats["p99_ms"], stats["max_ms"]))
+
+
+if __name__ == "__main__":
+    main()
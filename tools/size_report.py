@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Report the flash and RAM footprint of each Kconfig feature set.
+
+Builds an application that depends on this component once per sdkconfig
+fragment in tools/size_configs/ and prints the size of the component archive,
+of esp_http_server (only linked in with the portal) and of the app image:
+
+    python3 tools/size_report.py path/to/app
+
+Needs an activated ESP-IDF >= 5.3 environment. Each fragment is layered on top
+of the app's own sdkconfig.defaults and built in build_size_<name>/ inside the
+app directory, so the app's regular build is not touched.
+"""
+
+import argparse
+import glob
+import json
+import os
+import subprocess
+import sys
+
+CONFIG_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "size_configs")
+
+
+def archive_sizes(entry):
+    # esp-idf-size json2: {"memory_types": {"Flash Code": {"size": n}, "DIRAM": {...}}}
+    flash = ram = 0
+    for name, memory in entry.get("memory_types", {}).items():
+        if name.startswith("Flash"):
+            flash += memory["size"]
+        else:
+            ram += memory["size"]
+    return flash, ram
+
+
+def find_archive(archives, pattern):
+    for name, entry in archives.items():
+        if pattern in name:
+            return archive_sizes(entry)
+    return 0, 0
+
+
+def build(app, fragment, name, target):
+    build_dir = os.path.join(app, "build_size_" + name)
+    defaults = [fragment]
+    app_defaults = os.path.join(app, "sdkconfig.defaults")
+    if os.path.exists(app_defaults):
+        defaults.insert(0, app_defaults)
+    command = ["idf.py", "-C", app, "-B", build_dir,
+               "-DSDKCONFIG=" + os.path.join(build_dir, "sdkconfig"),
+               "-DSDKCONFIG_DEFAULTS=" + ";".join(defaults)]
+    if target:
+        command += ["-DIDF_TARGET=" + target]
+    subprocess.run(command + ["build"], check=True, stdout=subprocess.DEVNULL)
+    output = os.path.join(build_dir, "size_components.json")
+    subprocess.run(command + ["size-components", "--format", "json2", "--output-file", output],
+                   check=True, stdout=subprocess.DEVNULL)
+    with open(output) as f:
+        archives = json.load(f)
+    with open(os.path.join(build_dir, "project_description.json")) as f:
+        image = os.path.join(build_dir, json.load(f)["app_bin"])
+    return archives, os.path.getsize(image)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("app", help="ESP-IDF project that depends on this component")
+    parser.add_argument("--archive", default="wifi-connect", help="substring of the component archive name")
+    parser.add_argument("--target", help="IDF target, defaults to the app's")
+    parser.add_argument("configs", nargs="*", help="fragments to build, defaults to all in size_configs/")
+    args = parser.parse_args()
+
+    configs = args.configs or sorted(glob.glob(os.path.join(CONFIG_DIR, "*.cfg")))
+    print("%-14s %10s %10s %12s %12s" % ("config", "flash", "ram", "http_server", "image"))
+    for fragment in configs:
+        name = os.path.splitext(os.path.basename(fragment))[0]
+        archives, image_size = build(args.app, os.path.abspath(fragment), name, args.target)
+        flash, ram = find_archive(archives, args.archive)
+        if flash == 0 and ram == 0:
+            print("%s: no archive matching '%s'" % (name, args.archive), file=sys.stderr)
+            return 1
+        http_flash, _ = find_archive(archives, "libesp_http_server.a")
+        print("%-14s %10d %10d %12d %12d" % (name, flash, ram, http_flash, image_size))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""Host side of WifiBenchmark::RunThroughput().
+
+Run it on a machine on the same network as the device:
+
+    python3 tools/throughput_server.py --port 5001
+
+then call WifiBenchmark::RunThroughput("<host ip>", 5001, 10) on the device.
+Each connection starts with one mode byte: 'T' means the device sends and the
+server discards, 'R' means the server sends until the device closes.
+"""
+
+import argparse
+import socket
+import threading
+import time
+
+CHUNK = 64 * 1024
+
+
+def handle(conn, addr):
+    with conn:
+        mode = conn.recv(1)
+        start = time.monotonic()
+        total = 0
+        try:
+            if mode == b"T":
+                while True:
+                    data = conn.recv(CHUNK)
+                    if not data:
+                        break
+                    total += len(data)
+            elif mode == b"R":
+                payload = bytes(CHUNK)
+                while True:
+                    conn.sendall(payload)
+                    total += len(payload)
+        except OSError:
+            pass
+        elapsed = time.monotonic() - start
+        direction = {b"T": "device->host", b"R": "host->device"}.get(mode, "unknown")
+        if elapsed > 0:
+            print("%s %s: %d bytes in %.1fs, %.2f Mbit/s" % (addr[0], direction, total, elapsed, total * 8 / elapsed / 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--bind", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5001)
+    args = parser.parse_args()
+
+    server = socket.create_server((args.bind, args.port))
+    print("Listening on %s:%d" % (args.bind, args.port))
+    while True:
+        conn, addr = server.accept()
+        threading.Thread(target=handle, args=(conn, addr), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
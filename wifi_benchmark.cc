@@ -0,0 +1,317 @@
+#include "wifi_benchmark.h"
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
+#include "wifi_configuration_ap.h"
+#endif
+#include "wifi_credential_store.h"
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+#include "wifi_fast_wake.h"
+#endif
+#include "wifi_radio.h"
+#include "wifi_station.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TAG "WifiBenchmark"
+#define BENCH_NVS_NAMESPACE "wifi_bench"
+#define BENCH_THROUGHPUT_CHUNK 1460
+
+// Keeps the optimiser from dropping results that are otherwise unused
+static volatile size_t bench_sink;
+
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+// Survives the deep sleeps between the wakes of RunWakeToIp()
+RTC_DATA_ATTR static struct {
+    uint32_t cycle;
+    int count[2];           // indexed by fast wake
+    int64_t total_us[2];
+} wake_bench;
+#endif
+
+void WifiBenchmark::Report(const char *name, const char *variant, int iterations, int64_t elapsed_us)
+{
+    int64_t ns_per_op = iterations > 0 ? elapsed_us * 1000 / iterations : 0;
+    printf("BENCH {\"name\":\"%s\",\"variant\":\"%s\",\"iterations\":%d,\"total_us\":%lld,\"ns_per_op\":%lld}\n",
+        name, variant, iterations, (long long)elapsed_us, (long long)ns_per_op);
+}
+
+static void FillApRecords(std::vector<wifi_ap_record_t> &records, int count)
+{
+    records.assign(count, wifi_ap_record_t{});
+    for (int i = 0; i < count; i++) {
+        snprintf((char *)records[i].ssid, sizeof(records[i].ssid), "Bench-AP-%02d \"quoted\"", i);
+        records[i].rssi = -40 - (i % 50);
+        records[i].primary = 1 + (i % 13);
+        records[i].authmode = WIFI_AUTH_WPA2_PSK;
+    }
+}
+
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
+void WifiBenchmark::RunUrlDecode()
+{
+    const int iterations = 1000;
+    const int lengths[] = { 16, 64, 128 };
+    for (int length : lengths) {
+        // Half plain characters, half percent escapes, like a typical form post
+        std::string encoded = "ssid=";
+        while ((int)encoded.length() < length) {
+            encoded += (encoded.length() % 2) ? "%E4" : "a+";
+        }
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < iterations; i++) {
+            bench_sink = bench_sink + WifiConfigurationAp::UrlDecode(encoded).length();
+        }
+        char variant[16];
+        snprintf(variant, sizeof(variant), "len=%d", length);
+        Report("url_decode", variant, iterations, esp_timer_get_time() - start);
+    }
+}
+
+void WifiBenchmark::RunScanJson()
+{
+    const int iterations = 200;
+    const int ap_counts[] = { 1, 8, 32, 64 };
+    std::vector<wifi_ap_record_t> records;
+    for (int ap_count : ap_counts) {
+        FillApRecords(records, ap_count);
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < iterations; i++) {
+            bench_sink = bench_sink + WifiConfigurationAp::ScanResultsToJson(records.data(), ap_count).length();
+        }
+        char variant[16];
+        snprintf(variant, sizeof(variant), "aps=%d", ap_count);
+        Report("scan_json", variant, iterations, esp_timer_get_time() - start);
+    }
+}
+#endif
+
+void WifiBenchmark::RunMatch()
+{
+    const int iterations = 100;
+    const int store_sizes[] = { 1, WIFI_CFG_MAX, 8, 16 };
+    const int ap_counts[] = { 8, 32, 64 };
+    std::vector<wifi_ap_record_t> records;
+    for (int store_size : store_sizes) {
+        // Only the last stored network is in range: the worst case for the match loop
+        std::vector<wifi_cfg> cfgs(store_size, wifi_cfg{});
+        for (int num = 0; num < store_size; num++) {
+            cfgs[num].flag = true;
+            snprintf((char *)cfgs[num].cfg.sta.ssid, sizeof(cfgs[num].cfg.sta.ssid), "Stored-%02d", num);
+        }
+        for (int ap_count : ap_counts) {
+            FillApRecords(records, ap_count);
+            memcpy(records[ap_count - 1].ssid, cfgs[store_size - 1].cfg.sta.ssid, sizeof(cfgs[0].cfg.sta.ssid));
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; i < iterations; i++) {
+                int ap_index = 0;
+                bench_sink = bench_sink + WifiStation::FindBestMatch(cfgs.data(), store_size, records.data(), ap_count, &ap_index);
+            }
+            char variant[32];
+            snprintf(variant, sizeof(variant), "store=%d,aps=%d", store_size, ap_count);
+            Report("scan_match", variant, iterations, esp_timer_get_time() - start);
+        }
+    }
+}
+
+void WifiBenchmark::RunCredentialStore()
+{
+    const int iterations = 10;
+    WifiCredentialStore store(BENCH_NVS_NAMESPACE);
+    wifi_cfg cfgs[WIFI_CFG_MAX];
+
+    // Open network so the save path measures NVS only, PSK derivation is measured separately
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+        char ssid[16];
+        snprintf(ssid, sizeof(ssid), "Bench-%d", i % WIFI_CFG_MAX);
+        store.Save(ssid, "");
+    }
+    Report("credential_save", "open", iterations, esp_timer_get_time() - start);
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+        bench_sink = bench_sink + store.Load(cfgs, WIFI_CFG_MAX);
+    }
+    char variant[16];
+    snprintf(variant, sizeof(variant), "slots=%d", WIFI_CFG_MAX);
+    Report("credential_load", variant, iterations, esp_timer_get_time() - start);
+
+    nvs_handle_t nvs_handle;
+    if (nvs_open(BENCH_NVS_NAMESPACE, NVS_READWRITE, &nvs_handle) == ESP_OK) {
+        nvs_erase_all(nvs_handle);
+        nvs_commit(nvs_handle);
+        nvs_close(nvs_handle);
+    }
+}
+
+void WifiBenchmark::RunPskDerivation()
+{
+    const int iterations = 3;
+    int64_t average_us = WifiCredentialStore::BenchmarkDerivePsk("Bench-Network", "bench-passphrase", iterations);
+    Report("psk_derive", "pbkdf2_sha1_4096", iterations, average_us * iterations);
+}
+
+static int ConnectThroughputServer(const char *host, uint16_t port, char mode)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        return -1;
+    }
+    struct timeval timeout = { 2, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = inet_addr(host);
+    if (connect(sock, (struct sockaddr *)&to, sizeof(to)) != 0 || send(sock, &mode, 1, 0) != 1) {
+        ESP_LOGE(TAG, "Throughput server %s:%u not reachable", host, port);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void WifiBenchmark::RunThroughput(const char *host, uint16_t port, int seconds)
+{
+    const wifi_link_profile_cfg &profile = WifiStation::GetInstance().GetLinkProfile();
+    static char buffer[BENCH_THROUGHPUT_CHUNK];
+    const char modes[] = { 'T', 'R' };
+    for (char mode : modes) {
+        int sock = ConnectThroughputServer(host, port, mode);
+        if (sock < 0) {
+            return;
+        }
+        int64_t bytes = 0;
+        int64_t start = esp_timer_get_time();
+        int64_t end = start + (int64_t)seconds * 1000000;
+        while (esp_timer_get_time() < end) {
+            int len = mode == 'T' ? send(sock, buffer, sizeof(buffer), 0) : recv(sock, buffer, sizeof(buffer), 0);
+            if (len <= 0) {
+                break;
+            }
+            bytes += len;
+        }
+        int64_t elapsed_us = esp_timer_get_time() - start;
+        close(sock);
+
+        char variant[48];
+        snprintf(variant, sizeof(variant), "%s,%s,rx_buf=%d/%d", mode == 'T' ? "tx" : "rx",
+            profile.bandwidth == WIFI_BW_HT40 ? "HT40" : "HT20", profile.static_rx_buf, profile.dynamic_rx_buf);
+        // One op per KiB, so ns_per_op goes up when throughput goes down
+        Report("throughput", variant, bytes / 1024, elapsed_us);
+        ESP_LOGI(TAG, "%s: %.2f Mbit/s", variant, elapsed_us > 0 ? bytes * 8.0 / elapsed_us : 0.0);
+    }
+}
+
+void WifiBenchmark::RunRadioTransition()
+{
+    const int iterations = 5;
+    auto& radio = WifiRadio::GetInstance();
+    // Stand-ins for the station and the portal as radio owners
+    static int station;
+    static int portal;
+
+    // Old path: the failed station deinitialises the driver and the portal
+    // initialises it again. Netifs are kept, so this slightly flatters it.
+    int64_t elapsed_us = 0;
+    for (int i = 0; i < iterations; i++) {
+        radio.Acquire(&station, WIFI_MODE_STA);
+        int64_t start = esp_timer_get_time();
+        radio.Release(&station);
+        radio.Deinit();
+        radio.Acquire(&portal, WIFI_MODE_APSTA);
+        elapsed_us += esp_timer_get_time() - start;
+        radio.Release(&portal);
+        radio.Deinit();
+    }
+    Report("radio_transition", "sta_to_apsta,reinit", iterations, elapsed_us);
+
+    // The station hands the radio back and the portal restarts it in APSTA
+    elapsed_us = 0;
+    for (int i = 0; i < iterations; i++) {
+        radio.Acquire(&station, WIFI_MODE_STA);
+        int64_t start = esp_timer_get_time();
+        radio.Release(&station);
+        radio.Acquire(&portal, WIFI_MODE_APSTA);
+        elapsed_us += esp_timer_get_time() - start;
+        radio.Release(&portal);
+    }
+    Report("radio_transition", "sta_to_apsta,restart", iterations, elapsed_us);
+
+    // Both users at once: a mode switch on the running driver
+    elapsed_us = 0;
+    radio.Acquire(&station, WIFI_MODE_STA);
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = esp_timer_get_time();
+        radio.Acquire(&portal, WIFI_MODE_AP);
+        elapsed_us += esp_timer_get_time() - start;
+        radio.Release(&portal);
+    }
+    radio.Release(&station);
+    Report("radio_transition", "sta_to_apsta,switch", iterations, elapsed_us);
+}
+
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+void WifiBenchmark::RunWakeToIp(int cycles, uint32_t sleep_ms)
+{
+    auto& station = WifiStation::GetInstance();
+    bool cold_boot = esp_reset_reason() != ESP_RST_DEEPSLEEP;
+    if (cold_boot) {
+        memset(&wake_bench, 0, sizeof(wake_bench));
+    }
+    if (!station.IsConnected()) {
+        ESP_LOGE(TAG, "Wake to IP needs a connected station");
+        return;
+    }
+    int fast = station.IsFastWake() ? 1 : 0;
+    int64_t elapsed_us = (int64_t)station.GetWakeToIpMs() * 1000;
+    Report("wake_to_ip", cold_boot ? "cold" : (fast ? "fast" : "full"), 1, elapsed_us);
+    // Power-on costs more than a wake, so the first boot only seeds the RTC state
+    if (!cold_boot) {
+        wake_bench.count[fast]++;
+        wake_bench.total_us[fast] += elapsed_us;
+    }
+
+    if (++wake_bench.cycle <= (uint32_t)cycles) {
+        // Every other wake goes through NVS, scan and DHCP
+        if (wake_bench.cycle % 2 == 0) {
+            WifiFastWake::Invalidate();
+        }
+        esp_deep_sleep((uint64_t)sleep_ms * 1000);
+    }
+
+    Report("wake_to_ip", "full,total", wake_bench.count[0], wake_bench.total_us[0]);
+    Report("wake_to_ip", "fast,total", wake_bench.count[1], wake_bench.total_us[1]);
+    if (wake_bench.count[0] > 0 && wake_bench.count[1] > 0) {
+        int64_t saved_us = wake_bench.total_us[0] / wake_bench.count[0] - wake_bench.total_us[1] / wake_bench.count[1];
+        Report("wake_to_ip", "saved", 1, saved_us);
+    }
+    memset(&wake_bench, 0, sizeof(wake_bench));
+}
+#endif
+
+void WifiBenchmark::Run()
+{
+    ESP_LOGI(TAG, "Running benchmarks");
+#if CONFIG_WIFI_CONNECT_SOFTAP_PORTAL
+    RunUrlDecode();
+    RunScanJson();
+#endif
+    RunMatch();
+    RunCredentialStore();
+    RunPskDerivation();
+    ESP_LOGI(TAG, "Benchmarks done");
+}
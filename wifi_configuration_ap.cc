@@ -1,14 +1,25 @@
 #include "wifi_configuration_ap.h"
+#include "wifi_credential_store.h"
+#include "wifi_event_log.h"
+#include "wifi_radio.h"
+#include "wifi_station.h"
 #include <cstdio>
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_wifi.h>
 #include <esp_log.h>
 #include <esp_mac.h>
 #include <esp_netif.h>
+#include <esp_timer.h>
 #include <lwip/ip_addr.h>
 #include <nvs.h>
 #include <nvs_flash.h>
@@ -18,8 +29,30 @@
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
 
+struct submit_request {
+    WifiConfigurationAp *self;
+    std::vector<wifi_credential> creds;
+};
+
 extern const char index_html_start[] asm("_binary_wifi_configuration_ap_html_start");
 
+// Append str to json as the contents of a string literal
+static void AppendJsonString(std::string &json, const char *str)
+{
+    for (const char *p = str; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            json += '\\';
+            json += *p;
+        } else if ((unsigned char)*p < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*p);
+            json += escaped;
+        } else {
+            json += *p;
+        }
+    }
+}
+
 WifiConfigurationAp& WifiConfigurationAp::GetInstance() {
     static WifiConfigurationAp instance;
     return instance;
@@ -28,6 +61,8 @@ WifiConfigurationAp& WifiConfigurationAp::GetInstance() {
 WifiConfigurationAp::WifiConfigurationAp()
 {
     event_group_ = xEventGroupCreate();
+    scan_mutex_ = xSemaphoreCreateMutex();
+    scan_run_mutex_ = xSemaphoreCreateMutex();
 }
 
 WifiConfigurationAp::~WifiConfigurationAp()
@@ -35,12 +70,11 @@ WifiConfigurationAp::~WifiConfigurationAp()
     if (event_group_) {
         vEventGroupDelete(event_group_);
     }
-    // Unregister event handlers if they were registered
-    if (instance_any_id_) {
-        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id_);
+    if (scan_mutex_) {
+        vSemaphoreDelete(scan_mutex_);
     }
-    if (instance_got_ip_) {
-        esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip_);
+    if (scan_run_mutex_) {
+        vSemaphoreDelete(scan_run_mutex_);
     }
 }
 
@@ -52,19 +86,16 @@ void WifiConfigurationAp::SetSsidPrefix(const std::string &&ssid_prefix)
 void WifiConfigurationAp::Start()
 {
     // Register event handlers
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &WifiConfigurationAp::WifiEventHandler,
-                                                        this,
-                                                        &instance_any_id_));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &WifiConfigurationAp::IpEventHandler,
-                                                        this,
-                                                        &instance_got_ip_));
+    auto& radio = WifiRadio::GetInstance();
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiConfigurationAp::WifiEventHandler));
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, IP_EVENT, IP_EVENT_STA_GOT_IP, &WifiConfigurationAp::IpEventHandler));
 
     StartAccessPoint();
     StartWebServer();
+
+    if (recovery_cfg_.enabled) {
+        xTaskCreate(&WifiConfigurationAp::RecoveryTask, "portal_recovery", PORTAL_RECOVERY_STACK_SIZE, this, 2, NULL);
+    }
 }
 
 std::string WifiConfigurationAp::GetSsid()
@@ -88,11 +119,10 @@ void WifiConfigurationAp::StartAccessPoint()
     // Get the SSID
     std::string ssid = GetSsid();
 
-    // Initialize the TCP/IP stack
-    ESP_ERROR_CHECK(esp_netif_init());
-
-    // Create the default event loop
-    auto netif = esp_netif_create_default_wifi_ap();
+    // A station that gave up left the driver initialised, so this is only a
+    // switch to APSTA; the STA side is used for scans and connection tests
+    ESP_ERROR_CHECK(WifiRadio::GetInstance().Acquire(this, WIFI_MODE_APSTA));
+    auto netif = WifiRadio::GetInstance().GetApNetif();
 
     // Set the router IP address to 192.168.4.1
     esp_netif_ip_info_t ip_info;
@@ -103,10 +133,6 @@ void WifiConfigurationAp::StartAccessPoint()
     esp_netif_set_ip_info(netif, &ip_info);
     esp_netif_dhcps_start(netif);
 
-    // Initialize the WiFi stack in Access Point mode
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
     // Set the WiFi configuration
     wifi_config_t wifi_config = {};
     strcpy((char *)wifi_config.ap.ssid, ssid.c_str());
@@ -115,12 +141,80 @@ void WifiConfigurationAp::StartAccessPoint()
     wifi_config.ap.authmode = WIFI_AUTH_OPEN;
 
     // Start the WiFi Access Point
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
-    ESP_ERROR_CHECK(esp_wifi_start());
 
-    ESP_LOGI(TAG, "Access Point started with SSID %s", ssid.c_str());
+    // Scan once before any phone joins and settle on a channel, so later
+    // connection tests are less likely to pull the SoftAP away from it
+    Scan();
+    MoveApChannel(ChooseApChannel());
+
+    ESP_LOGI(TAG, "Access Point started with SSID %s on channel %d", ssid.c_str(), ap_channel_);
+}
+
+// Prefer the channel of a stored network in range, the station will have to
+// go there anyway. Otherwise take the least crowded of 1, 6 and 11.
+uint8_t WifiConfigurationAp::ChooseApChannel()
+{
+    // On the heap, this runs on whatever task called Start()
+    std::vector<wifi_cfg> cfgs(WIFI_CFG_MAX);
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    if (WifiCredentialStore::GetInstance().Load(cfgs.data(), WIFI_CFG_MAX)) {
+        int ap_index = 0;
+        int num = WifiStation::FindBestMatch(cfgs.data(), WIFI_CFG_MAX, scan_cache_.data(), scan_cache_.size(), &ap_index);
+        if (num >= 0) {
+            uint8_t channel = scan_cache_[ap_index].primary;
+            xSemaphoreGive(scan_mutex_);
+            return channel;
+        }
+    }
+    const uint8_t candidates[] = { 1, 6, 11 };
+    uint8_t best_channel = 1;
+    int best_load = INT32_MAX;
+    for (uint8_t channel : candidates) {
+        // Weight every overlapping AP by how loud it is
+        int load = 0;
+        for (auto &ap : scan_cache_) {
+            if (abs(ap.primary - channel) <= 2) {
+                load += std::max(ap.rssi + 100, 1);
+            }
+        }
+        if (load < best_load) {
+            best_load = load;
+            best_channel = channel;
+        }
+    }
+    xSemaphoreGive(scan_mutex_);
+    return best_channel;
+}
+
+// Channel of the strongest AP with this SSID in the last scan, 0 if not seen
+uint8_t WifiConfigurationAp::FindChannel(const std::string &ssid)
+{
+    uint8_t channel = 0;
+    int8_t rssi = INT8_MIN;
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    for (auto &ap : scan_cache_) {
+        if (strcmp((const char *)ap.ssid, ssid.c_str()) == 0 && ap.rssi > rssi) {
+            channel = ap.primary;
+            rssi = ap.rssi;
+        }
+    }
+    xSemaphoreGive(scan_mutex_);
+    return channel;
+}
+
+void WifiConfigurationAp::MoveApChannel(uint8_t channel)
+{
+    if (channel == 0 || channel == ap_channel_) {
+        return;
+    }
+    wifi_config_t wifi_config = {};
+    ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_AP, &wifi_config));
+    wifi_config.ap.channel = channel;
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
+    ESP_LOGI(TAG, "SoftAP moved from channel %d to %d", ap_channel_, channel);
+    ap_channel_ = channel;
 }
 
 void WifiConfigurationAp::StartWebServer()
@@ -128,6 +222,14 @@ void WifiConfigurationAp::StartWebServer()
     // Start the web server
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.max_open_sockets = server_cfg_.max_open_sockets;
+    config.lru_purge_enable = server_cfg_.lru_purge_enable;
+    config.recv_wait_timeout = server_cfg_.recv_wait_timeout;
+    config.send_wait_timeout = server_cfg_.send_wait_timeout;
+    config.keep_alive_enable = server_cfg_.keep_alive_enable;
+    config.keep_alive_idle = server_cfg_.keep_alive_idle;
+    config.keep_alive_interval = server_cfg_.keep_alive_interval;
+    config.keep_alive_count = server_cfg_.keep_alive_count;
     ESP_ERROR_CHECK(httpd_start(&server_, &config));
 
     // Register the index.html file
@@ -147,32 +249,14 @@ void WifiConfigurationAp::StartWebServer()
         .uri = "/scan",
         .method = HTTP_GET,
         .handler = [](httpd_req_t *req) -> esp_err_t {
-            esp_wifi_scan_start(nullptr, true);
-            uint16_t ap_num = 0;
-            esp_wifi_scan_get_ap_num(&ap_num);
-            wifi_ap_record_t *ap_records = (wifi_ap_record_t *)malloc(ap_num * sizeof(wifi_ap_record_t));
-            esp_wifi_scan_get_ap_records(&ap_num, ap_records);
-
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            std::string json = this_->GetScanJson();
             // Send the scan results as JSON
             httpd_resp_set_type(req, "application/json");
-            httpd_resp_sendstr_chunk(req, "[");
-            for (int i = 0; i < ap_num; i++) {
-                ESP_LOGI(TAG, "SSID: %s, RSSI: %d, Authmode: %d",
-                    (char *)ap_records[i].ssid, ap_records[i].rssi, ap_records[i].authmode);
-                char buf[128];
-                snprintf(buf, sizeof(buf), "{\"ssid\":\"%s\",\"rssi\":%d,\"authmode\":%d}",
-                    (char *)ap_records[i].ssid, ap_records[i].rssi, ap_records[i].authmode);
-                httpd_resp_sendstr_chunk(req, buf);
-                if (i < ap_num - 1) {
-                    httpd_resp_sendstr_chunk(req, ",");
-                }
-            }
-            httpd_resp_sendstr_chunk(req, "]");
-            httpd_resp_sendstr_chunk(req, NULL);
-            free(ap_records);
+            httpd_resp_send(req, json.c_str(), json.length());
             return ESP_OK;
         },
-        .user_ctx = NULL
+        .user_ctx = this
     };
     ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &scan));
 
@@ -181,55 +265,353 @@ void WifiConfigurationAp::StartWebServer()
         .uri = "/submit",
         .method = HTTP_POST,
         .handler = [](httpd_req_t *req) -> esp_err_t {
-            char buf[128];
-            int ret = httpd_req_recv(req, buf, sizeof(buf));
-            if (ret <= 0) {
-                if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-                    httpd_resp_send_408(req);
-                }
+            if (req->content_len > PORTAL_SUBMIT_MAX_BODY) {
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Form too large");
                 return ESP_FAIL;
             }
-            buf[ret] = '\0';
-            ESP_LOGI(TAG, "Received form data: %s", buf);
-
-            std::string decoded = UrlDecode(buf);
-            ESP_LOGI(TAG, "Decoded form data: %s", decoded.c_str());
+            std::string body(req->content_len, '\0');
+            size_t received = 0;
+            while (received < req->content_len) {
+                int ret = httpd_req_recv(req, &body[received], req->content_len - received);
+                if (ret <= 0) {
+                    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                        httpd_resp_send_408(req);
+                    }
+                    return ESP_FAIL;
+                }
+                received += ret;
+            }
 
-            // Parse the form data
-            char ssid[32], password[64];
-            if (sscanf(decoded.c_str(), "ssid=%32[^&]&password=%64s", ssid, password) != 2) {
+            // The form carries passwords, never log it
+            std::vector<wifi_credential> creds;
+            if (!ParseSubmitForm(body, creds)) {
                 httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid form data");
                 return ESP_FAIL;
             }
+            const char *ssid = creds[0].ssid.c_str();
+
+            WIFI_EVENT_LOG(WIFI_LOG_PORTAL_SUBMIT, creds.size(), WifiEventLog::HashSsid(ssid), 0);
+            ESP_LOGI(TAG, "Received form data for %d network(s), first SSID %s", (int)creds.size(), ssid);
 
             // Get this object from the user context
             auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
-            if (!this_->ConnectToWifi(ssid, password)) {
-                char error[] = "Failed to connect to WiFi";
-                char location[128];
-                snprintf(location, sizeof(location), "/?error=%s&ssid=%s", error, ssid);
-                
-                httpd_resp_set_status(req, "302 Found");
-                httpd_resp_set_hdr(req, "Location", location);
-                httpd_resp_send(req, NULL, 0);
+            // Only one connection test at a time, the background recovery counts as one
+            bool expected = false;
+            if (!this_->submit_busy_.compare_exchange_strong(expected, true)) {
+                httpd_resp_set_status(req, "503 Service Unavailable");
+                httpd_resp_set_hdr(req, "Retry-After", "10");
+                httpd_resp_send(req, "Another connection test is running", HTTPD_RESP_USE_STRLEN);
                 return ESP_OK;
             }
 
-            // Set HTML response
-            httpd_resp_set_status(req, "200 OK");
-            httpd_resp_set_type(req, "text/html");
-            httpd_resp_send(req, "<h1>Done!</h1>", -1);
-
-            this_->Save(ssid, password);
+            // The connection test takes seconds and may move the SoftAP to
+            // another channel, which drops the phone for a moment. Answer right
+            // away and let the page poll /status until the result is in.
+            this_->submit_results_.clear();
+            this_->submit_state_ = PORTAL_SUBMIT_TESTING;
+            std::string location = "/?connecting=" + UrlEncode(ssid);
+            auto *submit = new submit_request{ this_, std::move(creds) };
+            if (xTaskCreate(&WifiConfigurationAp::SubmitTask, "portal_submit", PORTAL_SUBMIT_STACK_SIZE, submit, 5, NULL) != pdPASS) {
+                this_->submit_state_ = PORTAL_SUBMIT_IDLE;
+                this_->submit_busy_ = false;
+                delete submit;
+                httpd_resp_send_500(req);
+                return ESP_FAIL;
+            }
+            httpd_resp_set_status(req, "303 See Other");
+            httpd_resp_set_hdr(req, "Location", location.c_str());
+            httpd_resp_send(req, NULL, 0);
             return ESP_OK;
         },
         .user_ctx = this
     };
     ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &form_submit));
 
+    // Result of the last /submit, polled by the page across the channel switch
+    httpd_uri_t status = {
+        .uri = "/status",
+        .method = HTTP_GET,
+        .handler = [](httpd_req_t *req) -> esp_err_t {
+            auto *this_ = static_cast<WifiConfigurationAp *>(req->user_ctx);
+            static const char *states[] = { "idle", "testing", "connected", "failed" };
+            std::string json = "{\"state\":\"";
+            static const char *results[] = { "saved", "not_found", "bad_password", "failed", "not_saved" };
+            int state = this_->submit_state_;
+            json += states[state];
+            json += "\",\"channel\":" + std::to_string(this_->ap_channel_);
+            json += ",\"max_networks\":" + std::to_string(WIFI_CFG_MAX);
+            if (state == PORTAL_SUBMIT_CONNECTED || state == PORTAL_SUBMIT_FAILED) {
+                // Both handlers run on the httpd task, so /submit cannot clear the results under us
+                json += ",\"networks\":[";
+                for (size_t i = 0; i < this_->submit_results_.size(); i++) {
+                    json += i > 0 ? ",{\"ssid\":\"" : "{\"ssid\":\"";
+                    AppendJsonString(json, this_->submit_results_[i].first.c_str());
+                    json += "\",\"result\":\"";
+                    json += results[this_->submit_results_[i].second];
+                    json += "\"}";
+                }
+                json += "]";
+            }
+            json += "}";
+            httpd_resp_set_type(req, "application/json");
+            httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+            httpd_resp_send(req, json.c_str(), json.length());
+            return ESP_OK;
+        },
+        .user_ctx = this
+    };
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server_, &status));
+
     ESP_LOGI(TAG, "Web server started");
 }
 
+void WifiConfigurationAp::SubmitTask(void *arg)
+{
+    auto *submit = static_cast<submit_request *>(arg);
+    auto *this_ = submit->self;
+    // Give the redirect a moment to reach the phone before the radio moves
+    vTaskDelay(pdMS_TO_TICKS(500));
+    auto &radio = WifiRadio::GetInstance();
+    if (radio.ClaimSta(this_)) {
+        this_->SubmitBatch(submit->creds);
+        radio.YieldSta(this_);
+    } else {
+        this_->HandOverBatch(submit->creds);
+    }
+    this_->submit_busy_ = false;
+    delete submit;
+    vTaskDelete(NULL);
+}
+
+// Check every network against one scan, test them in priority order until one
+// connects, then store all that passed with a single commit and reboot once
+void WifiConfigurationAp::SubmitBatch(std::vector<wifi_credential> &creds)
+{
+    std::vector<std::pair<std::string, portal_network_result>> results;
+    std::vector<wifi_credential> candidates;
+    // A scan cannot start while the STA is busy, e.g. with a background scan
+    // just finishing; never judge the networks against a list that is not fresh
+    for (int i = 0; i < 3 && !RefreshScan(); i++) {
+        vTaskDelay(pdMS_TO_TICKS(500));
+    }
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    for (auto &cred : creds) {
+        auto ap = std::find_if(scan_cache_.begin(), scan_cache_.end(), [&](const wifi_ap_record_t &record) {
+            return strcmp((const char *)record.ssid, cred.ssid.c_str()) == 0;
+        });
+        if (ap == scan_cache_.end()) {
+            results.emplace_back(cred.ssid, PORTAL_NETWORK_NOT_FOUND);
+        } else if (ap->authmode != WIFI_AUTH_OPEN && cred.password.length() < 8) {
+            results.emplace_back(cred.ssid, PORTAL_NETWORK_BAD_PASSWORD);
+        } else {
+            candidates.push_back(cred);
+        }
+    }
+    xSemaphoreGive(scan_mutex_);
+
+    std::stable_sort(candidates.begin(), candidates.end(), [](const wifi_credential &a, const wifi_credential &b) {
+        return a.priority > b.priority;
+    });
+    bool connected = false;
+    auto it = candidates.begin();
+    while (it != candidates.end() && !connected) {
+        connected = ConnectToWifi(it->ssid, it->password);
+        if (!connected) {
+            results.emplace_back(it->ssid, PORTAL_NETWORK_FAILED);
+            it = candidates.erase(it);
+            AbortConnect();
+        }
+    }
+    for (auto &cred : candidates) {
+        results.emplace_back(cred.ssid, connected ? PORTAL_NETWORK_SAVED : PORTAL_NETWORK_NOT_SAVED);
+    }
+    submit_results_ = std::move(results);
+    if (connected) {
+        WifiCredentialStore::GetInstance().SaveBatch(candidates.data(), candidates.size());
+    }
+    submit_state_ = connected ? PORTAL_SUBMIT_CONNECTED : PORTAL_SUBMIT_FAILED;
+    if (connected) {
+        ScheduleRestart();
+    }
+}
+
+// The station holds the STA, so there is no connection test to run. Store
+// the networks through it instead; it picks them up at its next scan.
+void WifiConfigurationAp::HandOverBatch(std::vector<wifi_credential> &creds)
+{
+    ESP_LOGI(TAG, "Station is running, storing %d network(s) without a connection test", (int)creds.size());
+    std::vector<std::pair<std::string, portal_network_result>> results;
+    bool saved = false;
+    for (auto &cred : creds) {
+        bool ok = WifiStation::GetInstance().AddNetwork(cred.ssid, cred.password, cred.priority) >= 0;
+        results.emplace_back(cred.ssid, ok ? PORTAL_NETWORK_SAVED : PORTAL_NETWORK_NOT_SAVED);
+        saved = saved || ok;
+    }
+    submit_results_ = std::move(results);
+    submit_state_ = saved ? PORTAL_SUBMIT_CONNECTED : PORTAL_SUBMIT_FAILED;
+}
+
+bool WifiConfigurationAp::ParseSubmitForm(const std::string &body, std::vector<wifi_credential> &creds)
+{
+    std::vector<bool> has_priority;
+    size_t start = 0;
+    while (start < body.length()) {
+        size_t end = body.find('&', start);
+        if (end == std::string::npos) {
+            end = body.length();
+        }
+        // Split before decoding so '&' and '=' inside a password survive
+        std::string field = body.substr(start, end - start);
+        start = end + 1;
+        size_t equals = field.find('=');
+        if (equals == std::string::npos) {
+            continue;
+        }
+        std::string key = field.substr(0, equals);
+        std::string value = UrlDecode(field.substr(equals + 1));
+        if (key == "ssid") {
+            if (value.empty() || value.length() > 32 || creds.size() == WIFI_CFG_MAX) {
+                return false;
+            }
+            // Two entries would end up in two slots of the store
+            if (std::any_of(creds.begin(), creds.end(), [&](const wifi_credential &cred) { return cred.ssid == value; })) {
+                return false;
+            }
+            creds.push_back({ value, "", 0 });
+            has_priority.push_back(false);
+        } else if (creds.empty()) {
+            return false;
+        } else if (key == "password") {
+            if (!WifiCredentialStore::IsValidPassword(value)) {
+                return false;
+            }
+            creds.back().password = value;
+        } else if (key == "priority") {
+            creds.back().priority = std::clamp(atoi(value.c_str()), 0, 255);
+            has_priority.back() = true;
+        }
+    }
+    for (size_t i = 0; i < creds.size(); i++) {
+        if (!has_priority[i]) {
+            creds[i].priority = creds.size() - i;
+        }
+    }
+    return !creds.empty();
+}
+
+// Every open page polls /scan. It is always answered from the cache, and a
+// stale cache is refreshed by a background task, so the httpd task never
+// sits through a scan.
+std::string WifiConfigurationAp::GetScanJson()
+{
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    bool fresh = ScanCacheFreshLocked();
+    WIFI_EVENT_LOG(WIFI_LOG_PORTAL_SCAN, scan_cache_.size(), fresh, 0);
+    std::string json = ScanResultsToJson(scan_cache_.data(), scan_cache_.size());
+    xSemaphoreGive(scan_mutex_);
+    // A connection test owns the STA and scans for itself
+    if (!fresh && !submit_busy_ && !scan_refreshing_.exchange(true)) {
+        if (xTaskCreate(&WifiConfigurationAp::ScanTask, "portal_scan", 4096, this, 2, NULL) != pdPASS) {
+            scan_refreshing_ = false;
+        }
+    }
+    return json;
+}
+
+void WifiConfigurationAp::ScanTask(void *arg)
+{
+    auto *this_ = static_cast<WifiConfigurationAp *>(arg);
+    // While the station runs, its own scans are the only ones
+    auto &radio = WifiRadio::GetInstance();
+    if (radio.ClaimSta(this_)) {
+        this_->Scan();
+        radio.YieldSta(this_);
+    }
+    this_->scan_refreshing_ = false;
+    vTaskDelete(NULL);
+}
+
+// The caller holds scan_mutex_
+bool WifiConfigurationAp::ScanCacheFreshLocked()
+{
+    int64_t now = esp_timer_get_time();
+    return scan_cache_time_ != 0 && now - scan_cache_time_ <= (int64_t)server_cfg_.scan_cache_ms * 1000;
+}
+
+// Rescan if the cache has gone stale. Returns true if the cache is fresh.
+bool WifiConfigurationAp::RefreshScan()
+{
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    bool fresh = ScanCacheFreshLocked();
+    xSemaphoreGive(scan_mutex_);
+    return fresh || Scan();
+}
+
+// Blocking scan into scan_cache_. Readers of the cache are only held up for
+// the swap. Returns false, and leaves the cache as it was, if the scan could
+// not start, e.g. while the STA is connecting.
+bool WifiConfigurationAp::Scan()
+{
+    std::vector<wifi_ap_record_t> records;
+    xSemaphoreTake(scan_run_mutex_, portMAX_DELAY);
+    esp_err_t err = esp_wifi_scan_start(nullptr, true);
+    if (err == ESP_OK) {
+        uint16_t ap_num = 0;
+        esp_wifi_scan_get_ap_num(&ap_num);
+        records.resize(ap_num);
+        esp_wifi_scan_get_ap_records(&ap_num, records.data());
+        records.resize(ap_num);
+    }
+    xSemaphoreGive(scan_run_mutex_);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Scan failed to start: %s", esp_err_to_name(err));
+        return false;
+    }
+    for (auto &ap : records) {
+        ESP_LOGV(TAG, "SSID: %s, RSSI: %d, Authmode: %d", (char *)ap.ssid, ap.rssi, ap.authmode);
+    }
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    scan_cache_.swap(records);
+    scan_cache_time_ = esp_timer_get_time();
+    xSemaphoreGive(scan_mutex_);
+    return true;
+}
+
+std::string WifiConfigurationAp::ScanResultsToJson(const wifi_ap_record_t *ap_records, uint16_t ap_num)
+{
+    std::string json;
+    json.reserve(16 + ap_num * 64);
+    json += "[";
+    for (int i = 0; i < ap_num; i++) {
+        if (i > 0) {
+            json += ",";
+        }
+        json += "{\"ssid\":\"";
+        AppendJsonString(json, (const char *)ap_records[i].ssid);
+        char buf[48];
+        snprintf(buf, sizeof(buf), "\",\"rssi\":%d,\"authmode\":%d}", ap_records[i].rssi, ap_records[i].authmode);
+        json += buf;
+    }
+    json += "]";
+    return json;
+}
+
+std::string WifiConfigurationAp::UrlEncode(const std::string &str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            encoded += c;
+        } else {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 0x0F];
+        }
+    }
+    return encoded;
+}
+
 std::string WifiConfigurationAp::UrlDecode(const std::string &url)
 {
     std::string decoded;
@@ -253,25 +635,38 @@ std::string WifiConfigurationAp::UrlDecode(const std::string &url)
 
 bool WifiConfigurationAp::ConnectToWifi(const std::string &ssid, const std::string &password)
 {
-    // auto esp_netif = esp_netif_create_default_wifi_sta();
-
     wifi_config_t wifi_config;
     bzero(&wifi_config, sizeof(wifi_config));
-    strcpy((char *)wifi_config.sta.ssid, ssid.c_str());
-    strcpy((char *)wifi_config.sta.password, password.c_str());
+    // A 32 character SSID or 64 digit PSK fills its field without a terminator
+    strncpy((char *)wifi_config.sta.ssid, ssid.c_str(), sizeof(wifi_config.sta.ssid));
+    strncpy((char *)wifi_config.sta.password, password.c_str(), sizeof(wifi_config.sta.password));
     wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
     wifi_config.sta.failure_retry_cnt = 1;
+
+    // Move the SoftAP to the target channel first, on our terms, and keep the
+    // station from sweeping every channel while phones are on the portal
+    uint8_t channel = FindChannel(ssid);
+    if (channel != 0) {
+        MoveApChannel(channel);
+        wifi_config.sta.channel = channel;
+        wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+    }
     
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    // Whatever an earlier attempt left behind is not the result of this one
+    xEventGroupClearBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
     auto ret = esp_wifi_connect();
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to connect to WiFi: %d", ret);
         return false;
     }
     ESP_LOGI(TAG, "Connecting to WiFi %s", ssid.c_str());
+    int64_t start = esp_timer_get_time();
 
     // Wait for the connection to complete for 5 seconds
     EventBits_t bits = xEventGroupWaitBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    WIFI_EVENT_LOG(WIFI_LOG_CONNECT_TEST, (bits & WIFI_CONNECTED_BIT) != 0, WifiEventLog::HashSsid(ssid.c_str()),
+                   (esp_timer_get_time() - start) / 1000);
     if (bits & WIFI_CONNECTED_BIT) {
         ESP_LOGI(TAG, "Connected to WiFi %s", ssid.c_str());
         return true;
@@ -281,55 +676,81 @@ bool WifiConfigurationAp::ConnectToWifi(const std::string &ssid, const std::stri
     }
 }
 
-void WifiConfigurationAp::Save(const std::string &ssid, const std::string &password)
+// Give up on a connection test and let its disconnect event land, so a late
+// event cannot be taken for the result of the next test
+void WifiConfigurationAp::AbortConnect()
 {
-    // Open the NVS flash
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("wifi", NVS_READWRITE, &nvs_handle));
-
-    // Write the SSID and password to the NVS flash
-    uint8_t wifi_flag = 0;
-    int32_t connect_cnt = 65535;
-    int re_num = 0;
-    for (int num = 0; num < 3; num++) {
-        std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
-        ESP_ERROR_CHECK(nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &wifi_flag));
-        if (wifi_flag == true) {
-            int32_t connect_cnt_temp = 0;
-            std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
-            ESP_ERROR_CHECK(nvs_get_i32(nvs_handle, con_cnt.c_str(), &connect_cnt_temp));
-            if (connect_cnt_temp <= connect_cnt) {
-                re_num = num;
-                connect_cnt = connect_cnt_temp;
-            }
-            std::string ssid_key = std::string("ssid") + std::to_string(num);
-            size_t length = 32;
-            char ssid_str[length];
-            ESP_ERROR_CHECK(nvs_get_str(nvs_handle, ssid_key.c_str(), ssid_str, &length));
-            if (strcmp(ssid_str, ssid.c_str()) == 0) {
-                re_num = num;
-                break;
-            } 
-        } else {
-            re_num = num;
-            break;
+    esp_wifi_disconnect();
+    xEventGroupWaitBits(event_group_, WIFI_FAIL_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(1000));
+    xEventGroupClearBits(event_group_, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
+}
+
+// Scan for the stored networks and try the strongest one. The scan also
+// refreshes the /scan cache, so it costs the portal nothing extra.
+bool WifiConfigurationAp::TryRecoverStation()
+{
+    wifi_cfg cfgs[WIFI_CFG_MAX];
+    if (!WifiCredentialStore::GetInstance().Load(cfgs, WIFI_CFG_MAX)) {
+        return false;
+    }
+
+    if (!Scan()) {
+        return false;
+    }
+    xSemaphoreTake(scan_mutex_, portMAX_DELAY);
+    int ap_index = 0;
+    int num = WifiStation::FindBestMatch(cfgs, WIFI_CFG_MAX, scan_cache_.data(), scan_cache_.size(), &ap_index);
+    xSemaphoreGive(scan_mutex_);
+    if (num < 0) {
+        return false;
+    }
+
+    const char *ssid = (const char *)cfgs[num].cfg.sta.ssid;
+    const char *password = (const char *)cfgs[num].cfg.sta.password;
+    std::string ssid_str(ssid, strnlen(ssid, sizeof(cfgs[num].cfg.sta.ssid)));
+    ESP_LOGI(TAG, "Stored network %s is back, trying to connect", ssid_str.c_str());
+    if (!ConnectToWifi(ssid_str, std::string(password, strnlen(password, sizeof(cfgs[num].cfg.sta.password))))) {
+        // Stop the STA from retrying in the background until the next round
+        AbortConnect();
+        return false;
+    }
+    return true;
+}
+
+void WifiConfigurationAp::RecoveryTask(void *arg)
+{
+    auto *this_ = static_cast<WifiConfigurationAp *>(arg);
+    uint32_t interval_ms = this_->recovery_cfg_.interval_ms;
+    while (true) {
+        // Scans and connect attempts move the radio off the SoftAP channel,
+        // so back off to the longest interval while a phone is on the portal
+        bool has_clients = this_->ap_client_count_ > 0;
+        vTaskDelay(pdMS_TO_TICKS(has_clients ? this_->recovery_cfg_.max_interval_ms : interval_ms));
+
+        // Never run next to a connection test started from /submit
+        bool expected = false;
+        if (!this_->submit_busy_.compare_exchange_strong(expected, true)) {
+            continue;
+        }
+        // Nothing to recover while the station holds the STA
+        auto &radio = WifiRadio::GetInstance();
+        bool recovered = false;
+        if (radio.ClaimSta(this_)) {
+            recovered = this_->TryRecoverStation();
+            radio.YieldSta(this_);
+        }
+        this_->submit_busy_ = false;
+        if (recovered) {
+            ESP_LOGI(TAG, "Stored network recovered, leaving the configuration portal");
+            ScheduleRestart();
+            vTaskDelete(NULL);
         }
+        interval_ms = std::min(interval_ms * 2, this_->recovery_cfg_.max_interval_ms);
     }
-    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(re_num);
-    std::string ssid_key = std::string("ssid") + std::to_string(re_num);
-    std::string psw_key = std::string("psw") + std::to_string(re_num);
-
-    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 1));
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, ssid_key.c_str(), ssid.c_str()));
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, psw_key.c_str(), password.c_str())); 
-    // Commit the changes
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    // Close the NVS flash
-    nvs_close(nvs_handle);
-
-    ESP_LOGI(TAG, "WiFi configuration saved %d:   ssid:%s  password:%s", re_num, ssid.c_str(), password.c_str());
+}
+
+void WifiConfigurationAp::ScheduleRestart()
+{
     // Use xTaskCreate to create a new task that restarts the ESP32
     xTaskCreate([](void *ctx) {
         ESP_LOGW(TAG, "Restarting the ESP32 in 3 second");
@@ -344,9 +765,16 @@ void WifiConfigurationAp::WifiEventHandler(void* arg, esp_event_base_t event_bas
     if (event_id == WIFI_EVENT_AP_STACONNECTED) {
         wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*) event_data;
         ESP_LOGI(TAG, "Station " MACSTR " joined, AID=%d", MAC2STR(event->mac), event->aid);
+        self->ap_client_count_++;
     } else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) {
         wifi_event_ap_stadisconnected_t* event = (wifi_event_ap_stadisconnected_t*) event_data;
         ESP_LOGI(TAG, "Station " MACSTR " left, AID=%d", MAC2STR(event->mac), event->aid);
+        if (self->ap_client_count_ > 0) {
+            self->ap_client_count_--;
+        }
+    } else if (WifiRadio::GetInstance().GetStaOwner() != self) {
+        // The station's connection, not one of our tests
+        return;
     } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
         xEventGroupSetBits(self->event_group_, WIFI_CONNECTED_BIT);
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
@@ -357,7 +785,7 @@ void WifiConfigurationAp::WifiEventHandler(void* arg, esp_event_base_t event_bas
 void WifiConfigurationAp::IpEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
     WifiConfigurationAp* self = static_cast<WifiConfigurationAp*>(arg);
-    if (event_id == IP_EVENT_STA_GOT_IP) {
+    if (event_id == IP_EVENT_STA_GOT_IP && WifiRadio::GetInstance().GetStaOwner() == self) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
         xEventGroupSetBits(self->event_group_, WIFI_CONNECTED_BIT);
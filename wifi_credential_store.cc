@@ -0,0 +1,430 @@
+#include "wifi_credential_store.h"
+#include "wifi_event_log.h"
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+#include "wifi_fast_wake.h"
+#endif
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <cctype>
+#include <vector>
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+#include <nvs_flash.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+
+#define TAG "WifiCredentialStore"
+
+#define WPA_PSK_ITERATIONS 4096
+#define WPA_PSK_BYTES 32
+// Holds a batch while SaveBatch() rewrites its slots
+#define BATCH_JOURNAL_KEY "batch"
+
+// One network of a batch as journaled to NVS
+struct batch_entry {
+    int8_t slot;
+    uint8_t priority;
+    uint8_t new_network;    // the slot held another SSID or nothing
+    uint8_t has_psk;
+    char ssid[33];
+    char password[65];
+    char psk[WIFI_PSK_HEX_LEN + 1];
+};
+
+WifiCredentialStore& WifiCredentialStore::GetInstance() {
+    static WifiCredentialStore instance("wifi");
+    return instance;
+}
+
+WifiCredentialStore::WifiCredentialStore(const char *nvs_namespace) : nvs_namespace_(nvs_namespace) {
+}
+
+bool WifiCredentialStore::Load(wifi_cfg *cfgs, int count)
+{
+    bool wifi_flag = false;
+    // Get ssid and password from NVS
+    nvs_handle_t nvs_handle;
+    auto ret = nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Open wifi nvs flash Error");
+        return false;
+    }
+    ReplayJournal(nvs_handle);
+    for (int num = 0; num < count; num++) {
+        if (LoadSlot(nvs_handle, num, &cfgs[num])) {
+            wifi_flag = true;
+        }
+    }
+    // Commit the changes
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+    return wifi_flag;
+}
+
+bool WifiCredentialStore::Load(int num, wifi_cfg *cfg)
+{
+    nvs_handle_t nvs_handle;
+    if (num < 0 || num >= WIFI_CFG_MAX || nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return false;
+    }
+    ReplayJournal(nvs_handle);
+    bool stored = LoadSlot(nvs_handle, num, cfg);
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+    return stored;
+}
+
+bool WifiCredentialStore::LoadSlot(nvs_handle_t nvs_handle, int num, wifi_cfg *cfg)
+{
+    memset(cfg, 0, sizeof(wifi_cfg));
+    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
+    esp_err_t err = nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &cfg->flag);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "err(%d)wifi_flag not found, setting default value. %s = %d", err, wifi_flag_key.c_str(), cfg->flag);
+        ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 0));
+        std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
+        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle, con_cnt.c_str(), 0));
+    }
+    ESP_LOGD(TAG, "Get : %s = %d", wifi_flag_key.c_str(), cfg->flag);
+    if (cfg->flag != true) {
+        cfg->flag = false;
+        return false;
+    }
+    std::string ssid_key = std::string("ssid") + std::to_string(num);
+    std::string psw_key = std::string("psw") + std::to_string(num);
+    std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
+    std::string channel_key = std::string("channel") + std::to_string(num);
+    std::string psk_key = std::string("psk") + std::to_string(num);
+    std::string prio_key = std::string("prio") + std::to_string(num);
+    if (nvs_get_i32(nvs_handle, con_cnt.c_str(), &cfg->connect_cnt) != ESP_OK) {
+        cfg->connect_cnt = 0;
+    }
+    // A 32 character SSID or a 64 digit PSK fills the driver's field, read
+    // them with room for the terminator NVS stores
+    char ssid[sizeof(cfg->cfg.sta.ssid) + 1] = {};
+    char password[sizeof(cfg->cfg.sta.password) + 1] = {};
+    size_t length = sizeof(ssid);
+    esp_err_t ssid_err = nvs_get_str(nvs_handle, ssid_key.c_str(), ssid, &length);
+    length = sizeof(password);
+    esp_err_t psw_err = nvs_get_str(nvs_handle, psw_key.c_str(), password, &length);
+    if (ssid_err != ESP_OK || psw_err != ESP_OK) {
+        ESP_LOGE(TAG, "WiFi configuration %d unreadable (%s), treating it as empty", num,
+                 esp_err_to_name(ssid_err != ESP_OK ? ssid_err : psw_err));
+        memset(cfg, 0, sizeof(wifi_cfg));
+        return false;
+    }
+    memcpy(cfg->cfg.sta.ssid, ssid, sizeof(cfg->cfg.sta.ssid));
+    memcpy(cfg->cfg.sta.password, password, sizeof(cfg->cfg.sta.password));
+    if (nvs_get_u8(nvs_handle, channel_key.c_str(), &cfg->channel) != ESP_OK) {
+        cfg->channel = 0;
+    }
+    if (nvs_get_u8(nvs_handle, prio_key.c_str(), &cfg->priority) != ESP_OK) {
+        cfg->priority = 0;
+    }
+    length = sizeof(cfg->psk);
+    if (nvs_get_str(nvs_handle, psk_key.c_str(), cfg->psk, &length) != ESP_OK) {
+        // Configs saved before PSKs were stored: derive once and keep it
+        if (DerivePsk(ssid, password, cfg->psk)) {
+            ESP_ERROR_CHECK(nvs_set_str(nvs_handle, psk_key.c_str(), cfg->psk));
+        } else {
+            cfg->psk[0] = '\0';
+        }
+    }
+    ESP_LOGI(TAG,"Get wifi config : ssid: %s , connect_cnt: %ld", ssid, cfg->connect_cnt);
+    return true;
+}
+
+int WifiCredentialStore::Find(const std::string &ssid)
+{
+    nvs_handle_t nvs_handle;
+    if (nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return -1;
+    }
+    ReplayJournal(nvs_handle);
+    int found = -1;
+    for (int num = 0; num < WIFI_CFG_MAX && found < 0; num++) {
+        uint8_t wifi_flag = 0;
+        std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
+        nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &wifi_flag);
+        if (wifi_flag != true) {
+            continue;
+        }
+        std::string ssid_key = std::string("ssid") + std::to_string(num);
+        char ssid_str[33] = {0};
+        size_t length = sizeof(ssid_str);
+        if (nvs_get_str(nvs_handle, ssid_key.c_str(), ssid_str, &length) == ESP_OK && strcmp(ssid_str, ssid.c_str()) == 0) {
+            found = num;
+        }
+    }
+    nvs_close(nvs_handle);
+    return found;
+}
+
+bool WifiCredentialStore::SetPriority(int num, uint8_t priority)
+{
+    nvs_handle_t nvs_handle;
+    if (num < 0 || num >= WIFI_CFG_MAX || nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return false;
+    }
+    ReplayJournal(nvs_handle);
+    std::string prio_key = std::string("prio") + std::to_string(num);
+    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, prio_key.c_str(), priority));
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+    return true;
+}
+
+// RTC memory may hold a copy of a slot of the station's store for the next
+// deep sleep wake. It must not outlive the slot being removed or rewritten.
+void WifiCredentialStore::SlotChanged(int num)
+{
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    if (this == &GetInstance()) {
+        WifiFastWake::InvalidateSlot(num);
+    }
+#endif
+}
+
+bool WifiCredentialStore::Remove(int num)
+{
+    nvs_handle_t nvs_handle;
+    if (num < 0 || num >= WIFI_CFG_MAX || nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle) != ESP_OK) {
+        return false;
+    }
+    ReplayJournal(nvs_handle);
+    SlotChanged(num);
+    // Clear the flag first, a slot without it is free whatever its other keys hold
+    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
+    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 0));
+    const char *keys[] = { "ssid", "psw", "psk", "channel", "prio" };
+    for (const char *key : keys) {
+        std::string slot_key = std::string(key) + std::to_string(num);
+        nvs_erase_key(nvs_handle, slot_key.c_str());
+    }
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
+    WIFI_EVENT_LOG(WIFI_LOG_REMOVE, num, 0, 0);
+    ESP_LOGI(TAG, "WiFi configuration %d removed", num);
+    return true;
+}
+
+bool WifiCredentialStore::DerivePsk(const std::string &ssid, const std::string &password, char psk[WIFI_PSK_HEX_LEN + 1])
+{
+    // WPA passphrases are 8..63 characters, anything else is either open or already a PSK
+    if (password.length() < 8 || password.length() >= WIFI_PSK_HEX_LEN || ssid.empty()) {
+        return false;
+    }
+    uint8_t key[WPA_PSK_BYTES];
+    int ret = mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1,
+                                            (const unsigned char *)password.data(), password.length(),
+                                            (const unsigned char *)ssid.data(), ssid.length(),
+                                            WPA_PSK_ITERATIONS, sizeof(key), key);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to derive PSK: %d", ret);
+        return false;
+    }
+    for (int i = 0; i < WPA_PSK_BYTES; i++) {
+        snprintf(psk + i * 2, 3, "%02x", key[i]);
+    }
+    memset(key, 0, sizeof(key));
+    return true;
+}
+
+bool WifiCredentialStore::IsValidPassword(const std::string &password)
+{
+    if (password.length() < WIFI_PSK_HEX_LEN) {
+        return true;
+    }
+    return password.length() == WIFI_PSK_HEX_LEN &&
+           std::all_of(password.begin(), password.end(), [](char ch) { return isxdigit((unsigned char)ch); });
+}
+
+int64_t WifiCredentialStore::BenchmarkDerivePsk(const std::string &ssid, const std::string &password, int rounds)
+{
+    char psk[WIFI_PSK_HEX_LEN + 1];
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < rounds; i++) {
+        DerivePsk(ssid, password, psk);
+    }
+    return rounds > 0 ? (esp_timer_get_time() - start) / rounds : 0;
+}
+
+int WifiCredentialStore::Save(const std::string &ssid, const std::string &password, uint8_t priority)
+{
+    wifi_credential cred = { ssid, password, priority };
+    int slot = -1;
+    SaveBatch(&cred, 1, &slot);
+    return slot;
+}
+
+int WifiCredentialStore::SaveBatch(const wifi_credential *creds, int count, int *slots, int keep_slot)
+{
+    count = std::min(count, WIFI_CFG_MAX);
+    // PBKDF2 takes a while per network, do it before touching NVS
+    std::vector<batch_entry> entries(count);
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < count; i++) {
+        batch_entry &entry = entries[i];
+        memset(&entry, 0, sizeof(entry));
+        strncpy(entry.ssid, creds[i].ssid.c_str(), sizeof(entry.ssid) - 1);
+        strncpy(entry.password, creds[i].password.c_str(), sizeof(entry.password) - 1);
+        entry.priority = creds[i].priority;
+        if (creds[i].psk.length() == WIFI_PSK_HEX_LEN) {
+            memcpy(entry.psk, creds[i].psk.c_str(), WIFI_PSK_HEX_LEN + 1);
+            entry.has_psk = true;
+        } else {
+            entry.has_psk = DerivePsk(creds[i].ssid, creds[i].password, entry.psk);
+        }
+    }
+    ESP_LOGI(TAG, "%d PSK(s) derived in %lld us", count, esp_timer_get_time() - start);
+
+    // Open the NVS flash
+    nvs_handle_t nvs_handle;
+    ESP_ERROR_CHECK(nvs_open(nvs_namespace_.c_str(), NVS_READWRITE, &nvs_handle));
+    ReplayJournal(nvs_handle);
+
+    // Snapshot the slots once instead of rereading them for every network
+    uint8_t flags[WIFI_CFG_MAX] = {};
+    int32_t connect_cnts[WIFI_CFG_MAX] = {};
+    char ssids[WIFI_CFG_MAX][33] = {};
+    for (int num = 0; num < WIFI_CFG_MAX; num++) {
+        std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
+        nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &flags[num]);
+        if (flags[num] == true) {
+            std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
+            nvs_get_i32(nvs_handle, con_cnt.c_str(), &connect_cnts[num]);
+            std::string ssid_key = std::string("ssid") + std::to_string(num);
+            size_t length = sizeof(ssids[num]);
+            if (nvs_get_str(nvs_handle, ssid_key.c_str(), ssids[num], &length) != ESP_OK) {
+                // Load() treats it as empty too
+                flags[num] = false;
+            }
+        }
+    }
+
+    bool claimed[WIFI_CFG_MAX] = {};
+    std::vector<batch_entry> journal;
+    for (int i = 0; i < count; i++) {
+        // Reuse the slot of the same SSID, else the first free slot, else the least used one
+        int re_num = -1;
+        for (int num = 0; num < WIFI_CFG_MAX && re_num < 0; num++) {
+            if (!claimed[num] && flags[num] == true && strcmp(ssids[num], entries[i].ssid) == 0) {
+                re_num = num;
+            }
+        }
+        for (int num = 0; num < WIFI_CFG_MAX && re_num < 0; num++) {
+            if (!claimed[num] && flags[num] != true) {
+                re_num = num;
+            }
+        }
+        if (re_num < 0) {
+            int32_t connect_cnt = INT32_MAX;
+            for (int num = 0; num < WIFI_CFG_MAX; num++) {
+                if (!claimed[num] && num != keep_slot && connect_cnts[num] <= connect_cnt) {
+                    re_num = num;
+                    connect_cnt = connect_cnts[num];
+                }
+            }
+        }
+        if (slots != nullptr) {
+            slots[i] = re_num;
+        }
+        if (re_num < 0) {
+            ESP_LOGW(TAG, "No slot left for ssid:%s", entries[i].ssid);
+            continue;
+        }
+        claimed[re_num] = true;
+        entries[i].slot = re_num;
+        entries[i].new_network = flags[re_num] != true || strcmp(ssids[re_num], entries[i].ssid) != 0;
+        journal.push_back(entries[i]);
+        SlotChanged(re_num);
+    }
+
+    // NVS only makes single keys atomic. The whole batch goes into one blob
+    // first, so a reset while the slot keys are rewritten is finished by the
+    // next open instead of leaving some slots old, some new and some empty.
+    if (!journal.empty()) {
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, BATCH_JOURNAL_KEY, journal.data(), journal.size() * sizeof(batch_entry)));
+        ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+        for (const batch_entry &entry : journal) {
+            WriteSlot(nvs_handle, entry);
+        }
+        ESP_ERROR_CHECK(nvs_erase_key(nvs_handle, BATCH_JOURNAL_KEY));
+    }
+    memset(entries.data(), 0, entries.size() * sizeof(batch_entry));
+    memset(journal.data(), 0, journal.size() * sizeof(batch_entry));
+    // Commit the changes
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    // Close the NVS flash
+    nvs_close(nvs_handle);
+    return journal.size();
+}
+
+void WifiCredentialStore::WriteSlot(nvs_handle_t nvs_handle, const batch_entry &entry)
+{
+    int num = entry.slot;
+    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
+    std::string ssid_key = std::string("ssid") + std::to_string(num);
+    std::string psw_key = std::string("psw") + std::to_string(num);
+    std::string psk_key = std::string("psk") + std::to_string(num);
+    std::string channel_key = std::string("channel") + std::to_string(num);
+    std::string prio_key = std::string("prio") + std::to_string(num);
+    std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
+
+    // Take the slot out of service until all of its keys are rewritten, even
+    // for the same SSID: a new passphrase must never be paired with the old PSK
+    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 0));
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, ssid_key.c_str(), entry.ssid));
+    // The passphrase is still needed for WPA3-SAE, the PSK is bound to this SSID
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, psw_key.c_str(), entry.password));
+    if (entry.has_psk) {
+        ESP_ERROR_CHECK(nvs_set_str(nvs_handle, psk_key.c_str(), entry.psk));
+    } else {
+        nvs_erase_key(nvs_handle, psk_key.c_str());
+    }
+    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, prio_key.c_str(), entry.priority));
+    // The channel of the previous network in this slot no longer applies
+    nvs_erase_key(nvs_handle, channel_key.c_str());
+    // Nor do its connect failures, a new network starts with a clean count
+    if (entry.new_network) {
+        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle, con_cnt.c_str(), 0));
+    }
+    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 1));
+
+    WIFI_EVENT_LOG(WIFI_LOG_SAVE, num, WifiEventLog::HashSsid(entry.ssid), entry.priority);
+    ESP_LOGI(TAG, "WiFi configuration saved %d:   ssid:%s priority:%d", num, entry.ssid, entry.priority);
+}
+
+// Finish a batch that a reset interrupted. Only SaveBatch() leaves the
+// journal behind, so it is looked for once per store.
+void WifiCredentialStore::ReplayJournal(nvs_handle_t nvs_handle)
+{
+    if (journal_checked_) {
+        return;
+    }
+    journal_checked_ = true;
+    size_t length = 0;
+    if (nvs_get_blob(nvs_handle, BATCH_JOURNAL_KEY, NULL, &length) != ESP_OK) {
+        return;
+    }
+    std::vector<batch_entry> journal(length / sizeof(batch_entry));
+    if (length % sizeof(batch_entry) != 0 || nvs_get_blob(nvs_handle, BATCH_JOURNAL_KEY, journal.data(), &length) != ESP_OK) {
+        ESP_LOGE(TAG, "Batch journal unreadable, dropping it");
+    } else {
+        ESP_LOGW(TAG, "Finishing a batch of %d interrupted by a reset", (int)journal.size());
+        for (const batch_entry &entry : journal) {
+            if (entry.slot >= 0 && entry.slot < WIFI_CFG_MAX) {
+                SlotChanged(entry.slot);
+                WriteSlot(nvs_handle, entry);
+            }
+        }
+        memset(journal.data(), 0, journal.size() * sizeof(batch_entry));
+    }
+    nvs_erase_key(nvs_handle, BATCH_JOURNAL_KEY);
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+}
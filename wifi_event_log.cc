@@ -0,0 +1,113 @@
+#include "wifi_event_log.h"
+#include <cstdio>
+
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+
+#define TAG "WifiEventLog"
+
+#if WIFI_EVENT_LOG_SIZE > 0
+static wifi_log_record log_records[WIFI_EVENT_LOG_SIZE];
+static uint32_t log_head = 0;   // total records written
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+void WifiEventLog::Write(uint16_t event, int16_t arg0, uint32_t arg1, uint32_t arg2)
+{
+#if WIFI_EVENT_LOG_SIZE > 0
+    uint32_t time_us = (uint32_t)esp_timer_get_time();
+    portENTER_CRITICAL_SAFE(&log_lock);
+    wifi_log_record &record = log_records[log_head % WIFI_EVENT_LOG_SIZE];
+    record.time_us = time_us;
+    record.event = event;
+    record.arg0 = arg0;
+    record.arg1 = arg1;
+    record.arg2 = arg2;
+    log_head++;
+    portEXIT_CRITICAL_SAFE(&log_lock);
+#endif
+}
+
+int WifiEventLog::Read(wifi_log_record *records, int max)
+{
+    int count = 0;
+#if WIFI_EVENT_LOG_SIZE > 0
+    portENTER_CRITICAL_SAFE(&log_lock);
+    uint32_t first = log_head > WIFI_EVENT_LOG_SIZE ? log_head - WIFI_EVENT_LOG_SIZE : 0;
+    for (uint32_t i = first; i < log_head && count < max; i++) {
+        records[count++] = log_records[i % WIFI_EVENT_LOG_SIZE];
+    }
+    portEXIT_CRITICAL_SAFE(&log_lock);
+#endif
+    return count;
+}
+
+uint32_t WifiEventLog::HashSsid(const void *ssid)
+{
+    // FNV-1a over at most the 32 bytes of an SSID
+    uint32_t hash = 2166136261u;
+    const uint8_t *p = static_cast<const uint8_t *>(ssid);
+    for (int i = 0; i < 32 && p[i] != 0; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char *EventName(uint16_t event)
+{
+    switch (event) {
+    case WIFI_LOG_SCAN_START: return "scan_start";
+    case WIFI_LOG_SCAN_DONE: return "scan_done";
+    case WIFI_LOG_SCAN_AP: return "scan_ap";
+    case WIFI_LOG_MATCH: return "match";
+    case WIFI_LOG_CONNECT: return "connect";
+    case WIFI_LOG_SCAN_TIME: return "scan_time";
+    case WIFI_LOG_DISCONNECTED: return "disconnected";
+    case WIFI_LOG_GOT_IP: return "got_ip";
+    case WIFI_LOG_PORTAL_SCAN: return "portal_scan";
+    case WIFI_LOG_PORTAL_SUBMIT: return "portal_submit";
+    case WIFI_LOG_CONNECT_TEST: return "connect_test";
+    case WIFI_LOG_SAVE: return "save";
+    case WIFI_LOG_PROBE_MISS: return "probe_miss";
+    case WIFI_LOG_RECOVERED: return "recovered";
+    case WIFI_LOG_REMOVE: return "remove";
+    case WIFI_LOG_SWITCH: return "switch";
+    case WIFI_LOG_RADIO_MODE: return "radio_mode";
+    case WIFI_LOG_WAKE_TO_IP: return "wake_to_ip";
+    case WIFI_LOG_FAST_WAKE_FAILED: return "fast_wake_failed";
+    default: return "unknown";
+    }
+}
+
+void WifiEventLog::Dump()
+{
+#if WIFI_EVENT_LOG_SIZE > 0
+    // Copy a few records at a time so the console output is not produced
+    // under the spinlock, and stop at the records present when called
+    wifi_log_record chunk[8];
+    portENTER_CRITICAL_SAFE(&log_lock);
+    uint32_t end = log_head;
+    portEXIT_CRITICAL_SAFE(&log_lock);
+    uint32_t next = end > WIFI_EVENT_LOG_SIZE ? end - WIFI_EVENT_LOG_SIZE : 0;
+    printf("%s: %d records\n", TAG, (int)(end - next));
+    while (next < end) {
+        int count = 0;
+        portENTER_CRITICAL_SAFE(&log_lock);
+        // Skip whatever new writes overwrote while printing
+        uint32_t oldest = log_head > WIFI_EVENT_LOG_SIZE ? log_head - WIFI_EVENT_LOG_SIZE : 0;
+        uint32_t lost = next < oldest ? oldest - next : 0;
+        next += lost;
+        for (; next < end && count < (int)(sizeof(chunk) / sizeof(chunk[0])); next++) {
+            chunk[count++] = log_records[next % WIFI_EVENT_LOG_SIZE];
+        }
+        portEXIT_CRITICAL_SAFE(&log_lock);
+        if (lost > 0) {
+            printf("%s: %lu records overwritten\n", TAG, (unsigned long)lost);
+        }
+        for (int i = 0; i < count; i++) {
+            printf("%10lu %-14s %6d 0x%08lx 0x%08lx\n", (unsigned long)chunk[i].time_us, EventName(chunk[i].event),
+                chunk[i].arg0, (unsigned long)chunk[i].arg1, (unsigned long)chunk[i].arg2);
+        }
+    }
+#endif
+}
@@ -0,0 +1,64 @@
+#include "wifi_fast_wake.h"
+#include <cstddef>
+#include <cstring>
+#include <sys/time.h>
+
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+
+#define TAG "WifiFastWake"
+
+// Zeroed on power-on, kept across deep sleep
+RTC_DATA_ATTR static wifi_wake_state wake_state;
+
+static uint32_t Checksum(const wifi_wake_state &state)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)&state, offsetof(wifi_wake_state, crc));
+}
+
+// The RTC timer keeps the system time running through deep sleep
+static int64_t WallClockUs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+bool WifiFastWake::Load(wifi_wake_state *state)
+{
+    if (wake_state.version != WIFI_WAKE_STATE_VERSION || wake_state.crc != Checksum(wake_state)) {
+        return false;
+    }
+    if (wake_state.slot >= WIFI_CFG_MAX || wake_state.ip == 0) {
+        return false;
+    }
+    int64_t age_us = WallClockUs() - wake_state.lease_time_us;
+    if (age_us < 0 || age_us > (int64_t)WIFI_WAKE_LEASE_AGE_S * 1000000) {
+        ESP_LOGI(TAG, "Lease is %lld s old, taking the full path", (long long)(age_us / 1000000));
+        return false;
+    }
+    *state = wake_state;
+    return true;
+}
+
+void WifiFastWake::Save(const wifi_wake_state &state)
+{
+    wake_state = state;
+    wake_state.version = WIFI_WAKE_STATE_VERSION;
+    wake_state.lease_time_us = WallClockUs();
+    wake_state.crc = Checksum(wake_state);
+}
+
+void WifiFastWake::Invalidate()
+{
+    memset(&wake_state, 0, sizeof(wake_state));
+}
+
+void WifiFastWake::InvalidateSlot(int slot)
+{
+    if (wake_state.version == WIFI_WAKE_STATE_VERSION && wake_state.slot == slot) {
+        ESP_LOGI(TAG, "Slot %d changed, dropping the retained state", slot);
+        Invalidate();
+    }
+}
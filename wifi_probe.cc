@@ -0,0 +1,178 @@
+#include "wifi_probe.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+#define ICMP_ECHO_ID 0x5746
+
+struct icmp_echo {
+    uint8_t type;
+    uint8_t code;
+    uint16_t checksum;
+    uint16_t id;
+    uint16_t seq;
+    uint8_t payload[8];
+};
+
+static uint16_t IcmpChecksum(const void *data, size_t length)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (length & 1) {
+        sum += p[length - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons(~sum & 0xFFFF);
+}
+
+static int64_t MonotonicUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+bool WifiProbe::Icmp(uint32_t addr, uint32_t timeout_ms)
+{
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (sock < 0) {
+        return false;
+    }
+    struct timeval timeout = { (time_t)(timeout_ms / 1000), (suseconds_t)((timeout_ms % 1000) * 1000) };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    static uint16_t seq = 0;
+    icmp_echo request = {};
+    request.type = ICMP_ECHO_REQUEST;
+    request.id = htons(ICMP_ECHO_ID);
+    request.seq = htons(++seq);
+    request.checksum = IcmpChecksum(&request, sizeof(request));
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = addr;
+    bool ok = false;
+    if (sendto(sock, &request, sizeof(request), 0, (struct sockaddr *)&to, sizeof(to)) == sizeof(request)) {
+        int64_t deadline = MonotonicUs() + timeout_ms * 1000LL;
+        uint8_t buf[64];
+        // Raw ICMP sockets see every echo reply, skip the ones that are not ours
+        while (!ok && MonotonicUs() < deadline) {
+            struct sockaddr_in from = {};
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+            if (len <= 0) {
+                break;
+            }
+            int ip_header_len = (buf[0] & 0x0F) * 4;
+            if (len < ip_header_len + (int)offsetof(icmp_echo, payload)) {
+                continue;
+            }
+            auto *reply = reinterpret_cast<icmp_echo *>(buf + ip_header_len);
+            ok = from.sin_addr.s_addr == addr && reply->type == ICMP_ECHO_REPLY &&
+                 reply->id == request.id && reply->seq == request.seq;
+        }
+    }
+    close(sock);
+    return ok;
+}
+
+bool WifiProbe::Tcp(uint32_t addr, uint16_t port, uint32_t timeout_ms)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    struct sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = addr;
+    bool ok = false;
+    int ret = connect(sock, (struct sockaddr *)&to, sizeof(to));
+    if (ret == 0) {
+        ok = true;
+    } else if (errno == EINPROGRESS) {
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        FD_SET(sock, &write_fds);
+        struct timeval timeout = { (time_t)(timeout_ms / 1000), (suseconds_t)((timeout_ms % 1000) * 1000) };
+        if (select(sock + 1, NULL, &write_fds, NULL, &timeout) > 0) {
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            ok = error == 0 || error == ECONNREFUSED;
+        }
+    } else {
+        ok = errno == ECONNREFUSED;
+    }
+    close(sock);
+    return ok;
+}
+
+ProbeSchedule::ProbeSchedule(uint32_t interval_ms, uint32_t min_interval_ms, int max_misses, uint32_t recovery_timeout_ms)
+    : healthy_interval_ms_(interval_ms), min_interval_ms_(min_interval_ms), max_misses_(max_misses),
+      recovery_timeout_ms_(recovery_timeout_ms), interval_ms_(interval_ms) {
+}
+
+bool ProbeSchedule::OnProbe(bool ok, int64_t now_us)
+{
+    if (ok) {
+        misses_ = 0;
+        // Back off towards the healthy interval again
+        interval_ms_ = std::min(interval_ms_ * 2, healthy_interval_ms_);
+        return false;
+    }
+    if (misses_++ == 0) {
+        first_miss_us_ = now_us;
+    }
+    // Confirm a suspected outage quickly
+    interval_ms_ = min_interval_ms_;
+    if (misses_ < max_misses_) {
+        return false;
+    }
+    recovering_ = true;
+    recovery_start_us_ = now_us;
+    interval_ms_ = healthy_interval_ms_;
+    return true;
+}
+
+bool ProbeSchedule::OnGotIp(int64_t now_us, uint32_t *since_first_miss_ms, uint32_t *since_recovery_ms)
+{
+    bool recovered = recovering_;
+    if (recovered) {
+        *since_first_miss_ms = (now_us - first_miss_us_) / 1000;
+        *since_recovery_ms = (now_us - recovery_start_us_) / 1000;
+        recovering_ = false;
+    }
+    misses_ = 0;
+    interval_ms_ = healthy_interval_ms_;
+    return recovered;
+}
+
+bool ProbeSchedule::OnRecoveryWait(int64_t now_us)
+{
+    // The station can run out of retries before it gets an IP, and then
+    // nobody would try again
+    if (!recovering_ || (now_us - recovery_start_us_) / 1000 < recovery_timeout_ms_) {
+        return false;
+    }
+    recovery_start_us_ = now_us;
+    return true;
+}
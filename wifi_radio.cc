@@ -0,0 +1,158 @@
+#include "wifi_radio.h"
+#include "wifi_event_log.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "WifiRadio"
+
+WifiRadio& WifiRadio::GetInstance() {
+    static WifiRadio instance;
+    return instance;
+}
+
+WifiRadio::WifiRadio() {
+    mutex_ = xSemaphoreCreateMutex();
+}
+
+WifiRadio::~WifiRadio() {
+    vSemaphoreDelete(mutex_);
+}
+
+esp_err_t WifiRadio::Acquire(void *owner, wifi_mode_t mode, const wifi_init_config_t *init_cfg) {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    user *slot = nullptr;
+    for (auto &entry : users_) {
+        if (entry.owner == owner) {
+            slot = &entry;
+            break;
+        }
+        if (slot == nullptr && entry.owner == nullptr) {
+            slot = &entry;
+        }
+    }
+    if (slot == nullptr) {
+        xSemaphoreGive(mutex_);
+        ESP_LOGE(TAG, "User table full");
+        return ESP_ERR_NO_MEM;
+    }
+    slot->owner = owner;
+    slot->mode = mode;
+    if (init_cfg != nullptr && initialized_) {
+        ESP_LOGW(TAG, "Driver already initialised, init config ignored");
+    }
+    ApplyLocked(init_cfg);
+    xSemaphoreGive(mutex_);
+    return ESP_OK;
+}
+
+bool WifiRadio::ClaimSta(void *owner) {
+    void *expected = nullptr;
+    return sta_owner_.compare_exchange_strong(expected, owner) || expected == owner;
+}
+
+void WifiRadio::YieldSta(void *owner) {
+    void *expected = owner;
+    sta_owner_.compare_exchange_strong(expected, nullptr);
+}
+
+void WifiRadio::Release(void *owner) {
+    YieldSta(owner);
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    for (auto &entry : handlers_) {
+        if (entry.owner == owner) {
+            ESP_ERROR_CHECK(esp_event_handler_instance_unregister(entry.base, entry.id, entry.instance));
+            entry = {};
+        }
+    }
+    for (auto &entry : users_) {
+        if (entry.owner == owner) {
+            entry = {};
+        }
+    }
+    ApplyLocked(nullptr);
+    xSemaphoreGive(mutex_);
+}
+
+void WifiRadio::Deinit() {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    if (initialized_ && mode_ == WIFI_MODE_NULL) {
+        ESP_ERROR_CHECK(esp_wifi_deinit());
+        initialized_ = false;
+    }
+    xSemaphoreGive(mutex_);
+}
+
+esp_err_t WifiRadio::RegisterHandler(void *owner, esp_event_base_t base, int32_t id, esp_event_handler_t handler) {
+    xSemaphoreTake(mutex_, portMAX_DELAY);
+    // Registering the same handler twice would deliver every event twice
+    for (auto &entry : handlers_) {
+        if (entry.owner == owner && entry.base == base && entry.id == id) {
+            xSemaphoreGive(mutex_);
+            return ESP_OK;
+        }
+    }
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    for (auto &entry : handlers_) {
+        if (entry.owner == nullptr) {
+            ret = esp_event_handler_instance_register(base, id, handler, owner, &entry.instance);
+            if (ret == ESP_OK) {
+                entry.owner = owner;
+                entry.base = base;
+                entry.id = id;
+            }
+            break;
+        }
+    }
+    xSemaphoreGive(mutex_);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register handler: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+// Bring the driver to the union of the users' modes. WIFI_MODE_APSTA is
+// WIFI_MODE_STA | WIFI_MODE_AP, so the union is a bitwise or.
+void WifiRadio::ApplyLocked(const wifi_init_config_t *init_cfg) {
+    int mode = WIFI_MODE_NULL;
+    for (auto &entry : users_) {
+        if (entry.owner != nullptr) {
+            mode |= entry.mode;
+        }
+    }
+    if (mode == mode_) {
+        return;
+    }
+
+    int64_t start = esp_timer_get_time();
+    wifi_mode_t previous = mode_;
+    if (mode == WIFI_MODE_NULL) {
+        ESP_ERROR_CHECK(esp_wifi_stop());
+    } else {
+        if (!netif_initialized_) {
+            ESP_ERROR_CHECK(esp_netif_init());
+            netif_initialized_ = true;
+        }
+        if ((mode & WIFI_MODE_STA) && sta_netif_ == nullptr) {
+            sta_netif_ = esp_netif_create_default_wifi_sta();
+            assert(sta_netif_ != NULL);
+        }
+        if ((mode & WIFI_MODE_AP) && ap_netif_ == nullptr) {
+            ap_netif_ = esp_netif_create_default_wifi_ap();
+            assert(ap_netif_ != NULL);
+        }
+        if (!initialized_) {
+            wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+            ESP_ERROR_CHECK(esp_wifi_init(init_cfg != nullptr ? init_cfg : &cfg));
+            initialized_ = true;
+        }
+        ESP_ERROR_CHECK(esp_wifi_set_mode((wifi_mode_t)mode));
+        if (previous == WIFI_MODE_NULL) {
+            ESP_ERROR_CHECK(esp_wifi_start());
+        }
+    }
+    mode_ = (wifi_mode_t)mode;
+    transition_us_ = esp_timer_get_time() - start;
+    WIFI_EVENT_LOG(WIFI_LOG_RADIO_MODE, previous << 4 | mode, transition_us_, 0);
+    ESP_LOGI(TAG, "Mode %d -> %d in %lld us", previous, mode, transition_us_);
+}
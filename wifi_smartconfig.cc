@@ -1,4 +1,6 @@
 #include "wifi_smartconfig.h"
+#include "wifi_credential_store.h"
+#include "wifi_radio.h"
 #include <cstdio>
 
 #include <freertos/FreeRTOS.h>
@@ -36,42 +38,17 @@ WifiSmartConfiguration::~WifiSmartConfiguration()
     if (event_group_) {
         vEventGroupDelete(event_group_);
     }
-    // Unregister event handlers if they were registered
-    esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiSmartConfiguration::WifiEventHandler);
-    esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &WifiSmartConfiguration::WifiEventHandler);
 }
 
 void WifiSmartConfiguration::Start()
 {
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_delete_default());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
-    assert(sta_netif);
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
-    // Register event handlers
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    esp_event_handler_instance_t instance_got_sc;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &WifiSmartConfiguration::WifiEventHandler,
-                                                        this,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &WifiSmartConfiguration::WifiEventHandler,
-                                                        this,
-                                                        &instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(SC_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &WifiSmartConfiguration::WifiEventHandler,
-                                                        this,
-                                                        &instance_got_sc));                                                    
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    // Register event handlers, then join the shared radio in station mode.
+    // The default event loop is shared with the other users, keep it.
+    auto& radio = WifiRadio::GetInstance();
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiSmartConfiguration::WifiEventHandler));
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, IP_EVENT, IP_EVENT_STA_GOT_IP, &WifiSmartConfiguration::WifiEventHandler));
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, SC_EVENT, ESP_EVENT_ANY_ID, &WifiSmartConfiguration::WifiEventHandler));
+    ESP_ERROR_CHECK(radio.Acquire(this, WIFI_MODE_STA));
     ESP_LOGI(TAG, "WiFi esp_wifi_start");
 
     EventBits_t uxBits;
@@ -97,51 +74,8 @@ void WifiSmartConfiguration::Start()
 
 void WifiSmartConfiguration::Save(const std::string &ssid, const std::string &password)
 {
-    // Open the NVS flash
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("wifi", NVS_READWRITE, &nvs_handle));
-    // Write the SSID and password to the NVS flash
-    uint8_t wifi_flag = 0;
-    int32_t connect_cnt = 65535;
-    int re_num = 0;
-    for (int num = 0; num < 3; num++) {
-        std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
-        nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &wifi_flag);
-        if (wifi_flag == true) {
-            int32_t connect_cnt_temp = 0;
-            std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
-            ESP_ERROR_CHECK(nvs_get_i32(nvs_handle, con_cnt.c_str(), &connect_cnt_temp));
-            if (connect_cnt_temp <= connect_cnt) {
-                re_num = num;
-                connect_cnt = connect_cnt_temp;
-            }
-            std::string ssid_key = std::string("ssid") + std::to_string(num);
-            size_t length = 32;
-            char ssid_str[length];
-            ESP_ERROR_CHECK(nvs_get_str(nvs_handle, ssid_key.c_str(), ssid_str, &length));
-            if (strcmp(ssid_str, ssid.c_str()) == 0) {
-                re_num = num;
-                break;
-            }           
-        } else {
-            re_num = num;
-            break;
-        }
-    }
-    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(re_num);
-    std::string ssid_key = std::string("ssid") + std::to_string(re_num);
-    std::string psw_key = std::string("psw") + std::to_string(re_num);
+    WifiCredentialStore::GetInstance().Save(ssid, password);
 
-    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), true));
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, ssid_key.c_str(), ssid.c_str()));
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, psw_key.c_str(), password.c_str()));
-    // Commit the changes
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    // Close the NVS flash
-    nvs_close(nvs_handle);
-    ESP_LOGI(TAG, "WiFi configuration saved");
     // Use xTaskCreate to create a new task that restarts the ESP32
     xTaskCreate([](void *ctx) {
         ESP_LOGI(TAG, "Restarting the ESP32 in 3 second");
@@ -200,7 +134,6 @@ void WifiSmartConfiguration::WifiEventHandler(void* arg, esp_event_base_t event_
         memcpy(ssid, evt->ssid, sizeof(evt->ssid));
         memcpy(password, evt->password, sizeof(evt->password));
         ESP_LOGI(TAG, "SSID:%s", ssid);
-        ESP_LOGI(TAG, "PASSWORD:%s", password);
         self->ssid_ = std::string(ssid);
         self->password_ = std::string(password);
 
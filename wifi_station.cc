@@ -1,5 +1,9 @@
 #include "wifi_station.h"
+#include "wifi_event_log.h"
+#include "wifi_radio.h"
 #include <cstring>
+#include <algorithm>
+#include <vector>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
@@ -9,11 +13,47 @@
 #include "nvs_flash.h"
 #include <esp_netif.h>
 #include <esp_system.h>
+#include <esp_timer.h>
+#include <soc/soc_caps.h>
 
 #define TAG "wifi"
 #define WIFI_EVENT_CONNECTED BIT0
 #define WIFI_EVENT_FAILED BIT1
 #define MAX_RECONNECT_COUNT 5
+// Connect attempts the driver makes before reporting a disconnect
+#define STA_FAILURE_RETRY_COUNT 5
+#define MAX_SCAN_TRY_COUNT 3
+// Wait before trying a scan again that could not start
+#define SCAN_RETRY_MS 1000
+
+#define REASSOCIATE_RETRY 1
+#define REASSOCIATE_FAILOVER 2
+#define REASSOCIATE_SWITCH 3
+
+#if SOC_WIFI_HE_SUPPORT
+#define WIFI_PROTOCOL_BGNAX (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_11AX)
+#else
+#define WIFI_PROTOCOL_BGNAX (WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)
+#endif
+#define WIFI_PROTOCOL_GN (WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N)
+
+// The ESP32-C2 radio is 20 MHz only
+#if CONFIG_IDF_TARGET_ESP32C2
+#define WIFI_BW_WIDEST WIFI_BW_HT20
+#else
+#define WIFI_BW_WIDEST WIFI_BW_HT40
+#endif
+
+// Indexed by wifi_link_profile. Balanced matches WIFI_INIT_CONFIG_DEFAULT()
+// with the stock sdkconfig.
+static const wifi_link_profile_cfg link_profiles[] = {
+    // bandwidth   protocol             ampdu tx/rx   ba_win static dynamic tx_power
+    { WIFI_BW_HT20, WIFI_PROTOCOL_BGNAX, false, false,  4,     4,     8,     60 },
+    { WIFI_BW_HT20, WIFI_PROTOCOL_BGNAX, true,  true,   6,    10,    32,     80 },
+    // 11b is left out so the AP never falls back to DSSS rates, 11ax because
+    // HE chips refuse HT40 with it
+    { WIFI_BW_WIDEST, WIFI_PROTOCOL_GN,  true,  true,  32,    16,    64,     80 },
+};
 
 WifiStation& WifiStation::GetInstance() {
     static WifiStation instance;
@@ -23,10 +63,30 @@ WifiStation& WifiStation::GetInstance() {
 WifiStation::WifiStation() {
     // Create the event group
     event_group_ = xEventGroupCreate();
+    cfg_mutex_ = xSemaphoreCreateMutex();
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    // Waking from deep sleep with intact RTC state: only that network is
+    // filled in, the rest of the table is read from NVS when it is needed
+    if (esp_reset_reason() == ESP_RST_DEEPSLEEP && WifiFastWake::Load(&wake_state_)) {
+        wifi_cfg &cfg = wifi_cfg_[wake_state_.slot];
+        cfg.flag = true;
+        cfg.channel = wake_state_.channel;
+        cfg.priority = wake_state_.priority;
+        memcpy(cfg.psk, wake_state_.psk, sizeof(cfg.psk));
+        memcpy(cfg.cfg.sta.ssid, wake_state_.ssid, sizeof(cfg.cfg.sta.ssid));
+        memcpy(cfg.cfg.sta.password, wake_state_.password, sizeof(cfg.cfg.sta.password));
+        wifi_num_ = wake_state_.slot;
+        fast_wake_ = true;
+        has_wifi_cfg_ = true;
+        return;
+    }
+#endif
     has_wifi_cfg_ = ReadConfig();
+    table_loaded_ = true;
 }
 
 void WifiStation::SaveConfig(int num, bool status) {
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
     // Get ssid and password from NVS
     nvs_handle_t nvs_handle;
     auto ret = nvs_open("wifi", NVS_READWRITE, &nvs_handle);
@@ -39,25 +99,23 @@ void WifiStation::SaveConfig(int num, bool status) {
                     wifi_cfg_[num].connect_cnt = 0;
                 }
                 wifi_cfg_[num].connect_cnt++;
-                ESP_LOGI(TAG,"Connect wifi config : ssid :%s ,passwd:%s ++", wifi_cfg_[num].cfg.sta.ssid, wifi_cfg_[num].cfg.sta.password);
+                // Remember the channel so the next boot scans it first
+                wifi_cfg_[num].channel = GetChannel();
+                std::string channel_key = std::string("channel") + std::to_string(num);
+                ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, channel_key.c_str(), wifi_cfg_[num].channel));
+                ESP_LOGI(TAG,"Connect wifi config : ssid :%.32s ++", wifi_cfg_[num].cfg.sta.ssid);
             } else {
-                ESP_LOGW(TAG,"Connect wifi config : ssid :%s ,passwd:%s  failed, ---", wifi_cfg_[num].cfg.sta.ssid, wifi_cfg_[num].cfg.sta.password);
+                ESP_LOGW(TAG,"Connect wifi config : ssid :%.32s  failed, ---", wifi_cfg_[num].cfg.sta.ssid);
                 if (wifi_cfg_[num].connect_cnt > 0 ) {
                     wifi_cfg_[num].connect_cnt = 0;
                 }
                 wifi_cfg_[num].connect_cnt--;
                 // connect fail 3 times to delete wifi record
                 if (wifi_cfg_[num].connect_cnt < -3) {
-                    ESP_LOGE(TAG,"Delete wifi config : ssid :%s ,passwd:%s", wifi_cfg_[num].cfg.sta.ssid, wifi_cfg_[num].cfg.sta.password);
-                    std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
-                    ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), 0));
-                    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-                    std::string ssid_key = std::string("ssid") + std::to_string(num);
-                    std::string psw_key = std::string("psw") + std::to_string(num); 
-                    ESP_ERROR_CHECK(nvs_erase_key(nvs_handle, ssid_key.c_str()));
-                    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-                    ESP_ERROR_CHECK(nvs_erase_key(nvs_handle, psw_key.c_str()));
-                    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+                    ESP_LOGE(TAG,"Delete wifi config : ssid :%.32s", wifi_cfg_[num].cfg.sta.ssid);
+                    WifiCredentialStore::GetInstance().Remove(num);
+                    wifi_cfg_[num].flag = false;
+                    wifi_cfg_[num].psk[0] = '\0';
                 }
             }
             ESP_ERROR_CHECK(nvs_set_i32(nvs_handle, con_cnt.c_str(), wifi_cfg_[num].connect_cnt));
@@ -67,61 +125,155 @@ void WifiStation::SaveConfig(int num, bool status) {
     // Commit the changes
     ESP_ERROR_CHECK(nvs_commit(nvs_handle));
     nvs_close(nvs_handle);
+    xSemaphoreGive(cfg_mutex_);
 }
 
 uint8_t WifiStation::ReadConfig() {
-    uint8_t wifi_flag = 0;
-    // Get ssid and password from NVS
-    nvs_handle_t nvs_handle;
-    auto ret = nvs_open("wifi", NVS_READWRITE, &nvs_handle);
-    if (ret == ESP_OK) {
-        for(int num = 0; num < WIFI_CFG_MAX; num++) {
-            std::string wifi_flag_key = std::string("wifi_flag") + std::to_string(num);
-            esp_err_t err = nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &wifi_cfg_[num].flag);
-            //ESP_ERROR_CHECK(nvs_get_u8(nvs_handle, wifi_flag_key.c_str(), &wifi_cfg_[num].flag));
-            if (err == ESP_ERR_NVS_NOT_FOUND) {
-                ESP_LOGW(TAG, "err(%d)wifi_flag not found, setting default value. %s = %d", err, wifi_flag_key.c_str(), wifi_cfg_[num].flag);
-                ESP_ERROR_CHECK(nvs_set_u8(nvs_handle, wifi_flag_key.c_str(), wifi_flag));
-                ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-                std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
-                int32_t connect_cnt = 0;
-                ESP_ERROR_CHECK(nvs_set_i32(nvs_handle, con_cnt.c_str(), connect_cnt));
-                ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-            }
-            ESP_LOGI(TAG, "Get : %s = %d", wifi_flag_key.c_str(), wifi_cfg_[num].flag);
-            if(wifi_cfg_[num].flag == true) {
-                wifi_flag = true;
-                std::string ssid_key = std::string("ssid") + std::to_string(num);
-                std::string psw_key = std::string("psw") + std::to_string(num);
-                std::string con_cnt = std::string("connect_cnt") + std::to_string(num);
-                ESP_ERROR_CHECK(nvs_get_i32(nvs_handle, con_cnt.c_str(), &wifi_cfg_[num].connect_cnt));
-                size_t length = sizeof(wifi_cfg_[num].cfg.sta.ssid);
-                ESP_ERROR_CHECK(nvs_get_str(nvs_handle, ssid_key.c_str(), (char*)wifi_cfg_[num].cfg.sta.ssid, &length));
-                length = sizeof(wifi_cfg_[num].cfg.sta.password);
-                ssid_ += std::string((char*)wifi_cfg_[num].cfg.sta.ssid); 
-                ESP_ERROR_CHECK(nvs_get_str(nvs_handle, psw_key.c_str(), (char*)wifi_cfg_[num].cfg.sta.password, &length));
-                ESP_LOGI(TAG,"Get wifi config : ssid: %s  psw: %s , connect_cnt: %ld", wifi_cfg_[num].cfg.sta.ssid, wifi_cfg_[num].cfg.sta.password,wifi_cfg_[num].connect_cnt);
-            } else {
-                wifi_cfg_[num].flag = false;
-                wifi_cfg_[num].connect_cnt = 0;
-            }
+    bool wifi_flag = WifiCredentialStore::GetInstance().Load(wifi_cfg_, WIFI_CFG_MAX);
+    for (int num = 0; num < WIFI_CFG_MAX; num++) {
+        if (wifi_cfg_[num].flag == true) {
+            ESP_LOGI(TAG, "Stored network %d: %.32s", num, (char*)wifi_cfg_[num].cfg.sta.ssid);
         }
-        // Commit the changes
-        ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-        nvs_close(nvs_handle);
-    } else {
-        ESP_LOGE(TAG, "Open wifi nvs flash Error");
     }
     return wifi_flag;
 }
 
+// The fast wake path fills in a single slot, read the whole table before
+// anything looks beyond it
+void WifiStation::LoadTable() {
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    if (!table_loaded_) {
+        has_wifi_cfg_ = WifiCredentialStore::GetInstance().Load(wifi_cfg_, WIFI_CFG_MAX);
+        table_loaded_ = true;
+    }
+    xSemaphoreGive(cfg_mutex_);
+}
+
 WifiStation::~WifiStation() {
+    if (scan_retry_timer_ != nullptr) {
+        esp_timer_stop(scan_retry_timer_);
+        esp_timer_delete(scan_retry_timer_);
+    }
     vEventGroupDelete(event_group_);
+    vSemaphoreDelete(cfg_mutex_);
+}
+
+const wifi_link_profile_cfg &WifiStation::GetLinkProfile(wifi_link_profile profile) {
+    if (profile > WIFI_PROFILE_HIGH_THROUGHPUT) {
+        profile = WIFI_PROFILE_BALANCED;
+    }
+    return link_profiles[profile];
+}
+
+uint32_t WifiStation::EstimateRam(const wifi_link_profile_cfg &profile) {
+    return (profile.static_rx_buf + profile.dynamic_rx_buf) * WIFI_RX_BUFFER_BYTES;
 }
 
 void WifiStation::SetAuth(const std::string &&ssid, const std::string &&password) {
-    ssid_ = ssid;
-    password_ = password;
+    AddNetwork(ssid, password);
+}
+
+int WifiStation::AddNetwork(const std::string &ssid, const std::string &password, uint8_t priority) {
+    if (ssid.empty() || ssid.length() > 32 || !WifiCredentialStore::IsValidPassword(password)) {
+        return -1;
+    }
+    LoadTable();
+    // PBKDF2 takes hundreds of milliseconds, keep it out of cfg_mutex_, which
+    // the event loop needs for every scan result
+    wifi_credential cred = { ssid, password, priority };
+    char psk[WIFI_PSK_HEX_LEN + 1];
+    if (WifiCredentialStore::DerivePsk(ssid, password, psk)) {
+        cred.psk = psk;
+    }
+    memset(psk, 0, sizeof(psk));
+    auto& store = WifiCredentialStore::GetInstance();
+    // The table being full must not evict the network we are on. With a
+    // single slot there is nothing else to evict, the new network replaces it.
+    int keep_slot = (WIFI_CFG_MAX > 1 && IsConnected()) ? wifi_num_ : -1;
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    int num = -1;
+    store.SaveBatch(&cred, 1, &num, keep_slot);
+    bool replaced = false;
+    if (num >= 0) {
+        replaced = wifi_cfg_[num].flag == true &&
+                   strncmp((const char *)wifi_cfg_[num].cfg.sta.ssid, ssid.c_str(), sizeof(wifi_cfg_[num].cfg.sta.ssid)) != 0;
+        store.Load(num, &wifi_cfg_[num]);
+        has_wifi_cfg_ = true;
+    }
+    xSemaphoreGive(cfg_mutex_);
+    // The network the station was on is gone from its slot, move to the new one
+    if (replaced && num == wifi_num_) {
+        SwitchToSlot(num);
+    }
+    return num;
+}
+
+bool WifiStation::SetNetworkPriority(const std::string &ssid, uint8_t priority) {
+    LoadTable();
+    auto& store = WifiCredentialStore::GetInstance();
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    int num = store.Find(ssid);
+    bool ok = num >= 0 && store.SetPriority(num, priority);
+    if (ok) {
+        wifi_cfg_[num].priority = priority;
+    }
+    xSemaphoreGive(cfg_mutex_);
+    return ok;
+}
+
+bool WifiStation::RemoveNetwork(const std::string &ssid) {
+    LoadTable();
+    auto& store = WifiCredentialStore::GetInstance();
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    int num = store.Find(ssid);
+    bool ok = num >= 0 && store.Remove(num);
+    if (ok) {
+        memset(&wifi_cfg_[num], 0, sizeof(wifi_cfg));
+    }
+    has_wifi_cfg_ = std::any_of(wifi_cfg_, wifi_cfg_ + WIFI_CFG_MAX, [](const wifi_cfg &cfg) { return cfg.flag == true; });
+    xSemaphoreGive(cfg_mutex_);
+    if (ok && num == wifi_num_ && IsConnected()) {
+        Reassociate(true);
+    }
+    return ok;
+}
+
+bool WifiStation::SwitchNetwork(const std::string &ssid) {
+    int num = WifiCredentialStore::GetInstance().Find(ssid);
+    if (num < 0) {
+        return false;
+    }
+    if (num == wifi_num_ && IsConnected()) {
+        return true;
+    }
+    WIFI_EVENT_LOG(WIFI_LOG_SWITCH, num, WifiEventLog::HashSsid(ssid.c_str()), 0);
+    return SwitchToSlot(num);
+}
+
+bool WifiStation::SwitchToSlot(int num) {
+    if (RescanIfGaveUp(-1, num)) {
+        return true;
+    }
+    // Before Start() nothing would pick the request up
+    if (!started_) {
+        return false;
+    }
+    // Picked up by the disconnect handler on the event loop task, like Reassociate()
+    switch_num_ = num;
+    reassociate_request_ = REASSOCIATE_SWITCH;
+    if (esp_wifi_disconnect() != ESP_OK) {
+        reassociate_request_ = 0;
+        return false;
+    }
+    return true;
+}
+
+int WifiStation::GetNetworks(wifi_cfg cfgs[WIFI_CFG_MAX]) {
+    LoadTable();
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    memcpy(cfgs, wifi_cfg_, sizeof(wifi_cfg_));
+    xSemaphoreGive(cfg_mutex_);
+    return std::count_if(cfgs, cfgs + WIFI_CFG_MAX, [](const wifi_cfg &cfg) { return cfg.flag == true; });
 }
 
 void WifiStation::Start() {
@@ -129,58 +281,546 @@ void WifiStation::Start() {
         ESP_LOGW(TAG, "Have no wifi config ,start config wifi");
         return;
     }
-    // Initialize the TCP/IP stack
-    ESP_ERROR_CHECK(esp_netif_init());
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &WifiStation::WifiEventHandler,
-                                                        this,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &WifiStation::IpEventHandler,
-                                                        this,
-                                                        &instance_got_ip));
-
-    // Create the default event loop
-    esp_netif_t *sta_netif = esp_netif_create_default_wifi_sta();
-    assert(sta_netif != NULL);
-    // Initialize the WiFi stack in station mode
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    if (IsConnected()) {
+        ESP_LOGW(TAG, "Already connected");
+        return;
+    }
+    xEventGroupClearBits(event_group_, WIFI_EVENT_FAILED);
+    // A second Start() after a failure gets the full retry budget again
+    started_ = false;
+    reconnect_count_ = 0;
+    scan_try_count_ = 0;
+    // Handlers go in first so the STA_START of this Acquire() is not missed
+    auto& radio = WifiRadio::GetInstance();
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiStation::WifiEventHandler));
+    ESP_ERROR_CHECK(radio.RegisterHandler(this, IP_EVENT, ESP_EVENT_ANY_ID, &WifiStation::IpEventHandler));
 
-    // Start the WiFi stack
-    ESP_ERROR_CHECK(esp_wifi_start());
+    // Buffer counts and aggregation only apply if this initialises the driver
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    cfg.ampdu_tx_enable = link_profile_.ampdu_tx;
+    cfg.ampdu_rx_enable = link_profile_.ampdu_rx;
+    cfg.rx_ba_win = link_profile_.rx_ba_win;
+    cfg.static_rx_buf_num = link_profile_.static_rx_buf;
+    cfg.dynamic_rx_buf_num = link_profile_.dynamic_rx_buf;
+    ESP_LOGI(TAG, "Link profile: %s ampdu=%d/%d rx_buf=%d/%d, up to %lu bytes of RX buffers",
+        link_profile_.bandwidth == WIFI_BW_HT40 ? "HT40" : "HT20", link_profile_.ampdu_tx, link_profile_.ampdu_rx,
+        link_profile_.static_rx_buf, link_profile_.dynamic_rx_buf, (unsigned long)EstimateRam(link_profile_));
+    // STA_START only comes if this Acquire() is what brings the STA interface
+    // up. If the portal or SmartConfig already runs it, go ahead ourselves.
+    bool sta_running = radio.GetMode() & WIFI_MODE_STA;
+    if (radio.Acquire(this, WIFI_MODE_STA, &cfg) != ESP_OK) {
+        radio.Release(this);
+        return;
+    }
+    if (sta_running) {
+        ESP_LOGI(TAG, "STA already running, start scan ap");
+        OnStaStart();
+    }
     // Wait for the WiFi stack to start
     auto bits = xEventGroupWaitBits(event_group_, WIFI_EVENT_CONNECTED | WIFI_EVENT_FAILED, pdFALSE, pdFALSE, portMAX_DELAY);
     if (bits & WIFI_EVENT_FAILED) {
         vTaskDelay(pdMS_TO_TICKS(3000));
         ESP_LOGE(TAG, "WifiStation failed");
-        // Reset the WiFi stack
-        ESP_ERROR_CHECK(esp_wifi_stop());
-        ESP_ERROR_CHECK(esp_wifi_deinit());
-        // 取消注册事件处理程序
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-        ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-        esp_netif_destroy(sta_netif);
-        sta_netif = NULL;
-        esp_netif_deinit();
+        UpdateStatus([](wifi_status &status) {
+            status.state = WIFI_LINK_IDLE;
+        });
+        // Unregister our handlers and hand the radio back. The driver stays
+        // initialised, so a portal started next only has to switch modes.
+        WifiRadio::GetInstance().Release(this);
+        return;
+    }
+    started_ = true;
+    // A fast wake stays off NVS; the channel is unchanged and the count can wait
+    if (!fast_wake_) {
+        SaveConfig(wifi_num_, true);
+    }
+    ESP_LOGI(TAG, "Connected to %s rssi=%d channel=%d", GetSsid().c_str(), GetRssi(), GetChannel());
+}
+
+// The STA interface is up: apply the profile and look for a network
+void WifiStation::OnStaStart() {
+    ApplyLinkProfile();
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    if (fast_wake_ && wake_to_ip_us_ == 0 && WifiRadio::GetInstance().ClaimSta(this)) {
+        ConnectFast();
+        return;
+    }
+#endif
+    BuildScanChannels();
+    StartScan();
+}
+
+// Per-interface settings of the link profile, applied once the STA interface is up
+// This runs in the event handler, so a setting the chip rejects is logged and
+// left at the driver default instead of aborting.
+void WifiStation::ApplyLinkProfile() {
+    // HT40 needs 11n in the protocol mask, so set the protocol first
+    esp_err_t err = esp_wifi_set_protocol(WIFI_IF_STA, link_profile_.protocol);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Protocol 0x%x rejected: %s", link_profile_.protocol, esp_err_to_name(err));
+    }
+    err = esp_wifi_set_bandwidth(WIFI_IF_STA, link_profile_.bandwidth);
+    if (err != ESP_OK && link_profile_.bandwidth != WIFI_BW_HT20) {
+        ESP_LOGW(TAG, "HT40 rejected: %s, falling back to HT20", esp_err_to_name(err));
+        err = esp_wifi_set_bandwidth(WIFI_IF_STA, WIFI_BW_HT20);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Bandwidth rejected: %s", esp_err_to_name(err));
+    }
+    err = esp_wifi_set_max_tx_power(link_profile_.max_tx_power);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "TX power %d rejected: %s", link_profile_.max_tx_power, esp_err_to_name(err));
+    }
+}
+
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+// Rejoin the network from before deep sleep: the address of the old lease
+// is set statically and the driver goes straight to the known BSSID, so
+// there is neither a scan nor a DHCP exchange
+void WifiStation::ConnectFast() {
+    esp_netif_t *netif = WifiRadio::GetInstance().GetStaNetif();
+    esp_netif_dhcpc_stop(netif);
+    esp_netif_ip_info_t ip_info = {};
+    ip_info.ip.addr = wake_state_.ip;
+    ip_info.netmask.addr = wake_state_.netmask;
+    ip_info.gw.addr = wake_state_.gateway;
+    ESP_ERROR_CHECK(esp_netif_set_ip_info(netif, &ip_info));
+    if (wake_state_.dns != 0) {
+        esp_netif_dns_info_t dns = {};
+        dns.ip.type = ESP_IPADDR_TYPE_V4;
+        dns.ip.u_addr.ip4.addr = wake_state_.dns;
+        esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+    }
+    ESP_LOGI(TAG, "Fast wake: rejoining slot %d on channel %d", wake_state_.slot, wake_state_.channel);
+    candidate_num_ = wake_state_.slot;
+    candidate_channel_ = wake_state_.channel;
+    candidate_authmode_ = (wifi_auth_mode_t)wake_state_.authmode;
+    candidate_rssi_ = 0;
+    candidate_bssid_ = wake_state_.bssid;
+    scan_start_time_ = esp_timer_get_time();
+    ConnectToCandidate();
+}
+
+// The AP from before sleeping did not take us back: drop the RTC state, turn
+// DHCP back on and go through the whole table and a scan
+void WifiStation::LeaveFastWake() {
+    WifiFastWake::Invalidate();
+    EndFastWake();
+    reconnect_count_ = 0;
+    scan_try_count_ = 0;
+    candidate_num_ = -1;
+    BuildScanChannels();
+    StartScan();
+}
+
+// Undo what ConnectFast() set up once its link is gone or another network is
+// picked: DHCP back on, the BSSID pin and single retry dropped from the STA
+// config, and the whole table loaded
+void WifiStation::EndFastWake() {
+    if (!fast_wake_) {
+        return;
+    }
+    fast_wake_ = false;
+    candidate_bssid_ = nullptr;
+    esp_netif_dhcpc_start(WifiRadio::GetInstance().GetStaNetif());
+    wifi_config_t cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &cfg) == ESP_OK) {
+        cfg.sta.bssid_set = false;
+        cfg.sta.failure_retry_cnt = STA_FAILURE_RETRY_COUNT;
+        esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    }
+    LoadTable();
+}
+
+// Called on a DHCP lease, so the next deep sleep wake can skip NVS, scan and DHCP
+void WifiStation::SaveWakeState(const esp_netif_ip_info_t &ip_info) {
+    wifi_wake_state state = {};
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    const wifi_cfg &cfg = wifi_cfg_[wifi_num_];
+    bool stored = cfg.flag == true;
+    memcpy(state.ssid, cfg.cfg.sta.ssid, sizeof(cfg.cfg.sta.ssid));
+    memcpy(state.password, cfg.cfg.sta.password, sizeof(cfg.cfg.sta.password));
+    memcpy(state.psk, cfg.psk, sizeof(state.psk));
+    state.priority = cfg.priority;
+    xSemaphoreGive(cfg_mutex_);
+    if (!stored) {
+        return;
+    }
+    wifi_status status = GetStatus();
+    state.slot = wifi_num_;
+    state.channel = status.channel;
+    state.authmode = candidate_authmode_;
+    memcpy(state.bssid, status.bssid, sizeof(state.bssid));
+    state.ip = ip_info.ip.addr;
+    state.netmask = ip_info.netmask.addr;
+    state.gateway = ip_info.gw.addr;
+    esp_netif_dns_info_t dns = {};
+    if (esp_netif_get_dns_info(WifiRadio::GetInstance().GetStaNetif(), ESP_NETIF_DNS_MAIN, &dns) == ESP_OK &&
+        dns.ip.type == ESP_IPADDR_TYPE_V4) {
+        state.dns = dns.ip.u_addr.ip4.addr;
+    }
+    WifiFastWake::Save(state);
+}
+#endif
+
+void WifiStation::BuildScanChannels() {
+    uint8_t max_channel = WIFI_SCAN_CHANNEL_MAX;
+    wifi_country_t country;
+    if (esp_wifi_get_country(&country) == ESP_OK && country.nchan > 0) {
+        max_channel = std::min<int>(country.schan + country.nchan - 1, WIFI_SCAN_CHANNEL_MAX);
+    }
+
+    bool added[WIFI_SCAN_CHANNEL_MAX + 1] = {};
+    scan_channel_count_ = 0;
+    auto add_channel = [&](uint8_t channel) {
+        if (channel >= 1 && channel <= max_channel && !added[channel]) {
+            added[channel] = true;
+            scan_channels_[scan_channel_count_++] = channel;
+        }
+    };
+    // Channels where stored networks were last seen come first
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    for (int num = 0; num < WIFI_CFG_MAX; num++) {
+        if (wifi_cfg_[num].flag == true) {
+            add_channel(wifi_cfg_[num].channel);
+        }
+    }
+    xSemaphoreGive(cfg_mutex_);
+    // Then the common non-overlapping channels, then everything else
+    add_channel(1);
+    add_channel(6);
+    add_channel(11);
+    for (uint8_t channel = 1; channel <= max_channel; channel++) {
+        add_channel(channel);
+    }
+    scan_channel_index_ = 0;
+    ESP_LOGI(TAG, "Scan plan: %d channels, first channel %d", scan_channel_count_, scan_channels_[0]);
+}
+
+void WifiStation::StartScan() {
+    if (scan_start_time_ == 0) {
+        scan_start_time_ = esp_timer_get_time();
+        UpdateStatus([](wifi_status &status) {
+            status.state = WIFI_LINK_SCANNING;
+        });
+    }
+    // The portal may be in the middle of a scan or a connection test, and a
+    // scan does not start while the STA is busy. Try again once it is done.
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (WifiRadio::GetInstance().ClaimSta(this)) {
+        if (!incremental_scan_ || scan_channel_count_ == 0) {
+            WIFI_EVENT_LOG(WIFI_LOG_SCAN_START, 0, 0, 0);
+            err = esp_wifi_scan_start(NULL, false);
+        } else {
+            wifi_scan_config_t scan_config = {};
+            scan_config.channel = scan_channels_[scan_channel_index_];
+            WIFI_EVENT_LOG(WIFI_LOG_SCAN_START, scan_config.channel, 0, 0);
+            err = esp_wifi_scan_start(&scan_config, false);
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Scan not started (%s), trying again", esp_err_to_name(err));
+        ScheduleScanRetry();
+    }
+}
+
+// On the next SCAN_DONE of whoever holds the STA, or after SCAN_RETRY_MS
+void WifiStation::ScheduleScanRetry() {
+    if (scan_retry_timer_ == nullptr) {
+        esp_timer_create_args_t timer_args = {};
+        timer_args.callback = [](void *arg) {
+            static_cast<WifiStation *>(arg)->RetryScan();
+        };
+        timer_args.arg = this;
+        timer_args.name = "sta_scan_retry";
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &scan_retry_timer_));
+    }
+    scan_retry_ = true;
+    esp_timer_stop(scan_retry_timer_);
+    esp_timer_start_once(scan_retry_timer_, SCAN_RETRY_MS * 1000);
+}
+
+void WifiStation::RetryScan() {
+    if (scan_retry_.exchange(false)) {
+        StartScan();
+    }
+}
+
+int WifiStation::FindBestMatch(const wifi_cfg *cfgs, int cfg_count, const wifi_ap_record_t *ap_records, uint16_t ap_count, int *ap_index) {
+    int best_num = -1;
+    for (int num = 0; num < cfg_count; num++) {
+        if (cfgs[num].flag == true) {
+            for (int i = 0; i < ap_count; i++) {
+                if (strncmp((const char *)cfgs[num].cfg.sta.ssid, (const char *)ap_records[i].ssid, sizeof(cfgs[num].cfg.sta.ssid)) == 0) {
+                    if (best_num < 0 || cfgs[num].priority > cfgs[best_num].priority ||
+                        (cfgs[num].priority == cfgs[best_num].priority && ap_records[i].rssi > ap_records[*ap_index].rssi)) {
+                        best_num = num;
+                        *ap_index = i;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return best_num;
+}
+
+// Match the scan records against the stored networks and keep the best
+// match, by priority and then RSSI, as the candidate. Returns true if the candidate is good enough to stop scanning.
+bool WifiStation::MatchScanRecords(const wifi_ap_record_t *ap_records, uint16_t ap_count) {
+    int i = 0;
+    // Failing over skips the network we left, switching only looks for the target.
+    // The copy goes on the heap, the event loop task has a small stack.
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    std::vector<wifi_cfg> cfgs(wifi_cfg_, wifi_cfg_ + WIFI_CFG_MAX);
+    xSemaphoreGive(cfg_mutex_);
+    for (int n = 0; n < WIFI_CFG_MAX; n++) {
+        if (n == exclude_num_ || (target_num_ >= 0 && n != target_num_)) {
+            cfgs[n].flag = false;
+        }
+    }
+    int num = FindBestMatch(cfgs.data(), WIFI_CFG_MAX, ap_records, ap_count, &i);
+    if (num >= 0) {
+        WIFI_EVENT_LOG(WIFI_LOG_MATCH, num, WifiEventLog::HashSsid(ap_records[i].ssid), ap_records[i].rssi);
+        ESP_LOGD(TAG, "Match SSID: %s, RSSI: %d, Authmode: %d", ap_records[i].ssid, ap_records[i].rssi, ap_records[i].authmode);
+    }
+    if (num >= 0 && (candidate_num_ < 0 || cfgs[num].priority > cfgs[candidate_num_].priority ||
+                     (cfgs[num].priority == cfgs[candidate_num_].priority && ap_records[i].rssi > candidate_rssi_))) {
+        candidate_num_ = num;
+        candidate_rssi_ = ap_records[i].rssi;
+        candidate_channel_ = ap_records[i].primary;
+        candidate_authmode_ = ap_records[i].authmode;
+    }
+    if (candidate_num_ < 0 || candidate_rssi_ < WIFI_SCAN_GOOD_RSSI) {
+        return false;
+    }
+    // Keep scanning while a stored network of higher priority may still show up
+    for (int n = 0; n < WIFI_CFG_MAX; n++) {
+        if (cfgs[n].flag == true && cfgs[n].priority > cfgs[candidate_num_].priority) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void WifiStation::ConnectToCandidate() {
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    // Any connect other than the fast wake one goes through DHCP again
+    if (candidate_bssid_ == nullptr) {
+        EndFastWake();
+    }
+#endif
+    xSemaphoreTake(cfg_mutex_, portMAX_DELAY);
+    wifi_cfg stored = wifi_cfg_[candidate_num_];
+    xSemaphoreGive(cfg_mutex_);
+    if (stored.flag != true) {
+        // Removed through the runtime API while we were scanning
+        candidate_num_ = -1;
+        scan_channel_index_ = 0;
+        StartScan();
         return;
     }
-    SaveConfig(wifi_num_, true);
-    ESP_LOGI(TAG, "Connected to %s rssi=%d channel=%d", ssid_.c_str(), GetRssi(), GetChannel());
+    scan_time_us_ = esp_timer_get_time() - scan_start_time_;
+    scan_start_time_ = 0;
+    WIFI_EVENT_LOG(WIFI_LOG_SCAN_TIME, incremental_scan_, GetScanTimeMs(), 0);
+    ESP_LOGI(TAG, "Scan finished in %lu ms (%s)", GetScanTimeMs(), incremental_scan_ ? "incremental" : "all channels");
+
+    wifi_config_t cfg = stored.cfg;
+    cfg.sta.failure_retry_cnt = STA_FAILURE_RETRY_COUNT;
+    // Let the driver start its own connect scan on the channel we just saw the AP on
+    cfg.sta.channel = candidate_channel_;
+    cfg.sta.pmf_cfg.capable = pmf_capable_;
+    cfg.sta.pmf_cfg.required = pmf_required_;
+    cfg.sta.sae_pwe_h2e = WPA3_SAE_PWE_BOTH;
+    // SAE needs the passphrase, plain WPA/WPA2-PSK can use the precomputed PSK
+    bool psk_only = candidate_authmode_ == WIFI_AUTH_WPA_PSK || candidate_authmode_ == WIFI_AUTH_WPA2_PSK ||
+                    candidate_authmode_ == WIFI_AUTH_WPA_WPA2_PSK;
+    bool use_psk = pmk_cache_ && psk_only && stored.psk[0] != '\0';
+    if (use_psk) {
+        memcpy(cfg.sta.password, stored.psk, WIFI_PSK_HEX_LEN);
+    }
+    if (candidate_bssid_ != nullptr) {
+        // Fast wake: only the AP we slept on, and give up after one try
+        cfg.sta.bssid_set = true;
+        memcpy(cfg.sta.bssid, candidate_bssid_, sizeof(cfg.sta.bssid));
+        cfg.sta.failure_retry_cnt = 1;
+    }
+    WIFI_EVENT_LOG(WIFI_LOG_CONNECT, candidate_num_, WifiEventLog::HashSsid(cfg.sta.ssid), candidate_channel_ << 8 | use_psk);
+    ESP_LOGI(TAG, "Start connect to SSID:%.32s channel:%d", cfg.sta.ssid, candidate_channel_);
+    UpdateStatus([&](wifi_status &status) {
+        status.state = WIFI_LINK_CONNECTING;
+        status.channel = candidate_channel_;
+        status.rssi = candidate_rssi_;
+        memcpy(status.ssid, cfg.sta.ssid, sizeof(cfg.sta.ssid));
+        status.ssid[sizeof(cfg.sta.ssid)] = '\0';
+    });
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &cfg));
+    esp_wifi_connect();
+    wifi_num_ = candidate_num_;
+    candidate_num_ = -1;
+    candidate_bssid_ = nullptr;
+    exclude_num_ = -1;
+    target_num_ = -1;
 }
 
 int8_t WifiStation::GetRssi() {
     // Get station info
     wifi_ap_record_t ap_info;
     ESP_ERROR_CHECK(esp_wifi_sta_get_ap_info(&ap_info));
+    UpdateStatus([&](wifi_status &status) {
+        status.rssi = ap_info.rssi;
+    });
     return ap_info.rssi;
 }
 
+// Writers serialise on status_lock_ and republish the whole snapshot
+template <typename F>
+void WifiStation::UpdateStatus(F update) {
+    portENTER_CRITICAL_SAFE(&status_lock_);
+    update(status_);
+    status_.generation++;
+    uint32_t words[sizeof(status_words_) / sizeof(status_words_[0])] = {};
+    memcpy(words, &status_, sizeof(status_));
+    uint32_t seq = status_seq_.load(std::memory_order_relaxed);
+    status_seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        status_words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    status_seq_.store(seq + 2, std::memory_order_release);
+    portEXIT_CRITICAL_SAFE(&status_lock_);
+}
+
+wifi_status WifiStation::GetStatus() const {
+    uint32_t words[sizeof(status_words_) / sizeof(status_words_[0])];
+    uint32_t seq;
+    do {
+        seq = status_seq_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+            words[i] = status_words_[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != status_seq_.load(std::memory_order_relaxed));
+    wifi_status status;
+    memcpy(&status, words, sizeof(status));
+    return status;
+}
+
+int WifiStation::AddListener(const listener &entry) {
+    int handle = -1;
+    portENTER_CRITICAL_SAFE(&listeners_lock_);
+    for (int i = 0; i < WIFI_LISTENER_MAX; i++) {
+        if (listeners_[i].callback == nullptr && listeners_[i].queue == nullptr) {
+            listeners_[i] = entry;
+            handle = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&listeners_lock_);
+    if (handle < 0) {
+        ESP_LOGE(TAG, "Listener table full");
+    }
+    return handle;
+}
+
+int WifiStation::Subscribe(wifi_link_callback_t callback, void *arg) {
+    return AddListener({ callback, arg, nullptr });
+}
+
+int WifiStation::Subscribe(QueueHandle_t queue) {
+    return AddListener({ nullptr, nullptr, queue });
+}
+
+void WifiStation::Unsubscribe(int handle) {
+    if (handle < 0 || handle >= WIFI_LISTENER_MAX) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&listeners_lock_);
+    listeners_[handle] = {};
+    portEXIT_CRITICAL_SAFE(&listeners_lock_);
+    // A Notify() in progress may still be calling the old entry from its
+    // copy. Wait for it, unless this is one of its callbacks unsubscribing.
+    if (xTaskGetCurrentTaskHandle() == notify_task_) {
+        return;
+    }
+    while (true) {
+        portENTER_CRITICAL_SAFE(&listeners_lock_);
+        bool busy = notify_task_ != nullptr;
+        portEXIT_CRITICAL_SAFE(&listeners_lock_);
+        if (!busy) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+}
+
+void WifiStation::Notify(wifi_link_event_id id, uint8_t reason) {
+    wifi_link_event event = { id, reason, GetStatus() };
+    // Call out without holding the lock so listeners may (un)subscribe
+    listener listeners[WIFI_LISTENER_MAX];
+    portENTER_CRITICAL_SAFE(&listeners_lock_);
+    memcpy(listeners, listeners_, sizeof(listeners));
+    notify_task_ = xTaskGetCurrentTaskHandle();
+    portEXIT_CRITICAL_SAFE(&listeners_lock_);
+    for (auto &entry : listeners) {
+        if (entry.callback != nullptr) {
+            entry.callback(event, entry.arg);
+        } else if (entry.queue != nullptr) {
+            xQueueSend(entry.queue, &event, 0);
+        }
+    }
+    portENTER_CRITICAL_SAFE(&listeners_lock_);
+    notify_task_ = nullptr;
+    portEXIT_CRITICAL_SAFE(&listeners_lock_);
+}
+
+// A station that gave up after its reconnects or scans keeps the radio but
+// is idle, no disconnect event would come. Start over from a scan with fresh
+// retry budgets. Returns false if the station had not given up.
+bool WifiStation::RescanIfGaveUp(int exclude_num, int target_num) {
+    if (!started_ || !(xEventGroupGetBits(event_group_) & WIFI_EVENT_FAILED)) {
+        return false;
+    }
+    ESP_LOGW(TAG, "Station had given up, scanning again");
+    xEventGroupClearBits(event_group_, WIFI_EVENT_FAILED);
+    reconnect_count_ = 0;
+    scan_try_count_ = 0;
+    scan_channel_index_ = 0;
+    candidate_num_ = -1;
+    exclude_num_ = exclude_num;
+    target_num_ = target_num;
+    LoadTable();
+    BuildScanChannels();
+    StartScan();
+    return true;
+}
+
+void WifiStation::Reassociate(bool failover) {
+    if (RescanIfGaveUp(failover ? wifi_num_ : -1, -1)) {
+        return;
+    }
+    // The disconnect handler picks the request up on the event loop task
+    reassociate_request_ = failover ? REASSOCIATE_FAILOVER : REASSOCIATE_RETRY;
+    if (esp_wifi_disconnect() != ESP_OK) {
+        reassociate_request_ = 0;
+    }
+}
+
+std::string WifiStation::GetSsid() const {
+    return GetStatus().ssid;
+}
+
+std::string WifiStation::GetIpAddress() const {
+    wifi_status status = GetStatus();
+    if (status.ip == 0) {
+        return "";
+    }
+    char ip_address[16];
+    esp_ip4_addr_t ip = { .addr = status.ip };
+    esp_ip4addr_ntoa(&ip, ip_address, sizeof(ip_address));
+    return ip_address;
+}
+
 uint8_t WifiStation::GetChannel() {
     // Get station info
     wifi_ap_record_t ap_info;
@@ -199,11 +839,73 @@ void WifiStation::SetPowerSaveMode(bool enabled) {
 // Static event handler functions
 void WifiStation::WifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     auto* this_ = static_cast<WifiStation*>(arg);
+    // Scans and connection tests of the portal are none of our business, but
+    // the end of its scan is a good moment to try ours again
+    if (event_id != WIFI_EVENT_STA_START && WifiRadio::GetInstance().GetStaOwner() != this_) {
+        if (event_id == WIFI_EVENT_SCAN_DONE) {
+            this_->RetryScan();
+        }
+        return;
+    }
     if (event_id == WIFI_EVENT_STA_START) {
         ESP_LOGI(TAG, "WIFI event start and then start scan ap");
-        ESP_ERROR_CHECK(esp_wifi_scan_start(NULL, false));
+        this_->OnStaStart();
+    } else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+        auto* event = static_cast<wifi_event_sta_connected_t*>(event_data);
+        // Same network through another BSSID than last time counts as a roam
+        wifi_status previous = this_->GetStatus();
+        static const uint8_t no_bssid[6] = {};
+        bool roamed = memcmp(previous.bssid, no_bssid, sizeof(no_bssid)) != 0 &&
+                      memcmp(previous.bssid, event->bssid, sizeof(previous.bssid)) != 0 &&
+                      strlen(previous.ssid) == event->ssid_len &&
+                      memcmp(previous.ssid, event->ssid, event->ssid_len) == 0;
+        this_->UpdateStatus([&](wifi_status &status) {
+            status.state = WIFI_LINK_ASSOCIATED;
+            status.channel = event->channel;
+            memcpy(status.bssid, event->bssid, sizeof(status.bssid));
+            memcpy(status.ssid, event->ssid, event->ssid_len);
+            status.ssid[event->ssid_len] = '\0';
+        });
+        this_->Notify(roamed ? WIFI_LINK_EVENT_ROAMED : WIFI_LINK_EVENT_CONNECTED);
     } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        auto* event = static_cast<wifi_event_sta_disconnected_t*>(event_data);
+        WIFI_EVENT_LOG(WIFI_LOG_DISCONNECTED, event->reason, this_->reconnect_count_, 0);
+        this_->UpdateStatus([&](wifi_status &status) {
+            status.state = WIFI_LINK_DISCONNECTED;
+            status.rssi = event->rssi;
+            status.ip = 0;
+            status.gateway = 0;
+        });
+        this_->Notify(WIFI_LINK_EVENT_DISCONNECTED, event->reason);
         xEventGroupClearBits(this_->event_group_, WIFI_EVENT_CONNECTED);
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+        if (this_->fast_wake_ && this_->wake_to_ip_us_ == 0) {
+            WIFI_EVENT_LOG(WIFI_LOG_FAST_WAKE_FAILED, event->reason, 0, 0);
+            ESP_LOGW(TAG, "Fast wake failed, reason %d, falling back to a full connect", event->reason);
+            this_->reassociate_request_ = 0;
+            this_->LeaveFastWake();
+            return;
+        }
+        // The fast wake link is gone, whatever comes next reconnects the usual way
+        this_->EndFastWake();
+#endif
+        int request = this_->reassociate_request_.exchange(0);
+        if (request == REASSOCIATE_FAILOVER || request == REASSOCIATE_SWITCH) {
+            this_->LoadTable();
+            if (request == REASSOCIATE_FAILOVER) {
+                this_->exclude_num_ = this_->wifi_num_;
+            } else {
+                this_->target_num_ = this_->switch_num_;
+            }
+            this_->reconnect_count_ = 0;
+            this_->scan_try_count_ = 0;
+            this_->scan_channel_index_ = 0;
+            this_->candidate_num_ = -1;
+            this_->StartScan();
+            return;
+        } else if (request == REASSOCIATE_RETRY) {
+            this_->reconnect_count_ = 0;
+        }
         if (this_->reconnect_count_ < MAX_RECONNECT_COUNT) {
             esp_wifi_connect();
             this_->reconnect_count_++;
@@ -211,15 +913,16 @@ void WifiStation::WifiEventHandler(void* arg, esp_event_base_t event_base, int32
         } else {
             this_->SaveConfig(this_->wifi_num_, false);
             xEventGroupSetBits(this_->event_group_, WIFI_EVENT_FAILED);
+            // Idle now, let the portal scan and test connections
+            WifiRadio::GetInstance().YieldSta(this_);
             ESP_LOGE(TAG, "WiFi connection failed");
         }
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
-        ESP_LOGI(TAG, "Scan done");
         uint16_t ap_count = 0;
-        this_->scan_try_count_++;
-        bool has_match_wifi = false;
+        bool good_candidate = false;
         esp_wifi_scan_get_ap_num(&ap_count);
-        ESP_LOGI(TAG, "Get %d aviable ap points", ap_count);
+        WIFI_EVENT_LOG(WIFI_LOG_SCAN_DONE, ap_count, 0, 0);
+        ESP_LOGD(TAG, "Scan done, get %d aviable ap points", ap_count);
         if (ap_count > 0) {
             wifi_ap_record_t *ap_records = (wifi_ap_record_t *)malloc(sizeof(wifi_ap_record_t) * ap_count);
             if (ap_records == NULL) {
@@ -228,55 +931,94 @@ void WifiStation::WifiEventHandler(void* arg, esp_event_base_t event_base, int32
             }
             esp_wifi_scan_get_ap_records(&ap_count, ap_records);
             for (int i = 0; i < ap_count; i++) {
-                ESP_LOGI(TAG, "SSID: %s, RSSI: %d, Authmode: %d", 
-                            ap_records[i].ssid, 
-                            ap_records[i].rssi, 
+                WIFI_EVENT_LOG(WIFI_LOG_SCAN_AP, ap_records[i].rssi, WifiEventLog::HashSsid(ap_records[i].ssid),
+                               ap_records[i].primary << 8 | ap_records[i].authmode);
+                ESP_LOGV(TAG, "SSID: %s, RSSI: %d, Authmode: %d",
+                            ap_records[i].ssid,
+                            ap_records[i].rssi,
                             ap_records[i].authmode);
             }
-            for(int num = 0; num < WIFI_CFG_MAX; num++) {
-                if (this_->wifi_cfg_[num].flag == true) {
-                    for (int i = 0; i < ap_count; i++) {
-                        ESP_LOGI(TAG, "Match SSID: %s, RSSI: %d, Authmode: %d", 
-                                    ap_records[i].ssid, 
-                                    ap_records[i].rssi, 
-                                    ap_records[i].authmode);
-                        if (strcmp((const char *)this_->wifi_cfg_[num].cfg.sta.ssid, (const char *)ap_records[i].ssid) == 0) {
-                            free(ap_records);
-                            has_match_wifi = true;
-                            ap_records = nullptr;
-                            this_->wifi_cfg_[num].cfg.sta.failure_retry_cnt = 5;
-                            ESP_LOGI(TAG, "Start connect to SSID:%s , PSW:%s", this_->wifi_cfg_[num].cfg.sta.ssid, this_->wifi_cfg_[num].cfg.sta.password);
-                            ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &this_->wifi_cfg_[num].cfg));
-                            esp_wifi_connect();
-                            this_->wifi_num_ = num;
-                            break;
-                        }
-                    }
-                }
-            }
-            if(this_->scan_try_count_ == 3) {
-                xEventGroupSetBits(this_->event_group_, WIFI_EVENT_FAILED);
-                ESP_LOGE(TAG, "WiFi scan fail");
-            }
-            if(ap_records != nullptr)
-                free(ap_records);
-            if(has_match_wifi == false && this_->scan_try_count_ < 3) {
-                ESP_ERROR_CHECK(esp_wifi_scan_start(NULL, false));
-            }
+            good_candidate = this_->MatchScanRecords(ap_records, ap_count);
+            free(ap_records);
+        } else {
+            esp_wifi_clear_ap_list();
+        }
+
+        if (good_candidate) {
+            this_->ConnectToCandidate();
+            return;
+        }
+        // Move on to the next channel until the whole plan has been visited
+        if (this_->incremental_scan_ && ++this_->scan_channel_index_ < this_->scan_channel_count_) {
+            this_->StartScan();
+            return;
+        }
+        this_->scan_channel_index_ = 0;
+        this_->scan_try_count_++;
+        if (this_->candidate_num_ >= 0) {
+            this_->ConnectToCandidate();
+        } else if (this_->exclude_num_ >= 0) {
+            // No other stored network in range, go back to the one we left
+            ESP_LOGW(TAG, "No network to fail over to, retrying slot %d", this_->exclude_num_);
+            this_->exclude_num_ = -1;
+            this_->StartScan();
+        } else if (this_->target_num_ >= 0) {
+            ESP_LOGW(TAG, "Network to switch to not found, picking any stored network");
+            this_->target_num_ = -1;
+            this_->StartScan();
+        } else if (this_->scan_try_count_ >= MAX_SCAN_TRY_COUNT) {
+            xEventGroupSetBits(this_->event_group_, WIFI_EVENT_FAILED);
+            WifiRadio::GetInstance().YieldSta(this_);
+            ESP_LOGE(TAG, "WiFi scan fail");
         } else {
             ESP_LOGW(TAG, "Start Scan again try");
-            ESP_ERROR_CHECK(esp_wifi_scan_start(NULL, false));
+            this_->StartScan();
         }
     } 
 }
 
 void WifiStation::IpEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
     auto* this_ = static_cast<WifiStation*>(arg);
+    if (WifiRadio::GetInstance().GetStaOwner() != this_) {
+        return;
+    }
+    if (event_id == IP_EVENT_STA_LOST_IP) {
+        this_->UpdateStatus([](wifi_status &status) {
+            if (status.state == WIFI_LINK_CONNECTED) {
+                status.state = WIFI_LINK_ASSOCIATED;
+            }
+            status.ip = 0;
+            status.gateway = 0;
+        });
+        xEventGroupClearBits(this_->event_group_, WIFI_EVENT_CONNECTED);
+        ESP_LOGW(TAG, "Lost IP");
+        this_->Notify(WIFI_LINK_EVENT_LOST_IP);
+        return;
+    } else if (event_id != IP_EVENT_STA_GOT_IP) {
+        return;
+    }
     auto* event = static_cast<ip_event_got_ip_t*>(event_data);
 
-    char ip_address[16];
-    esp_ip4addr_ntoa(&event->ip_info.ip, ip_address, sizeof(ip_address));
-    this_->ip_address_ = ip_address;
-    ESP_LOGI(TAG, "Got IP: %s", this_->ip_address_.c_str());
+    this_->UpdateStatus([&](wifi_status &status) {
+        status.state = WIFI_LINK_CONNECTED;
+        status.ip = event->ip_info.ip.addr;
+        status.gateway = event->ip_info.gw.addr;
+    });
+    WIFI_EVENT_LOG(WIFI_LOG_GOT_IP, 0, event->ip_info.ip.addr, 0);
+    ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+    if (this_->wake_to_ip_us_ == 0) {
+        this_->wake_to_ip_us_ = esp_timer_get_time();
+        WIFI_EVENT_LOG(WIFI_LOG_WAKE_TO_IP, this_->fast_wake_, this_->GetWakeToIpMs(), 0);
+        ESP_LOGI(TAG, "IP %lu ms after boot%s", this_->GetWakeToIpMs(), this_->fast_wake_ ? " (fast wake)" : "");
+    }
+#if CONFIG_WIFI_CONNECT_FAST_WAKE
+    // A static address from the RTC state is not a new lease, keep its age
+    if (!this_->fast_wake_) {
+        this_->SaveWakeState(event->ip_info);
+    }
+#endif
+    this_->reconnect_count_ = 0;
+    this_->scan_try_count_ = 0;
     xEventGroupSetBits(this_->event_group_, WIFI_EVENT_CONNECTED);
+    this_->Notify(WIFI_LINK_EVENT_GOT_IP);
 }
@@ -0,0 +1,121 @@
+#include "wifi_supervisor.h"
+#include "wifi_station.h"
+#include "wifi_event_log.h"
+#include "wifi_probe.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <arpa/inet.h>
+
+#define TAG "WifiSupervisor"
+
+WifiSupervisor& WifiSupervisor::GetInstance() {
+    static WifiSupervisor instance;
+    return instance;
+}
+
+bool WifiSupervisor::Probe()
+{
+    wifi_status status = WifiStation::GetInstance().GetStatus();
+    if (config_.probe_gateway && status.gateway != 0 && !WifiProbe::Icmp(status.gateway, config_.timeout_ms)) {
+        return false;
+    }
+    if (!config_.tcp_host.empty() && config_.tcp_port != 0) {
+        struct in_addr addr;
+        if (inet_aton(config_.tcp_host.c_str(), &addr) == 0) {
+            ESP_LOGE(TAG, "Invalid TCP probe address %s", config_.tcp_host.c_str());
+            return true;
+        }
+        return WifiProbe::Tcp(addr.s_addr, config_.tcp_port, config_.timeout_ms);
+    }
+    return true;
+}
+
+void WifiSupervisor::SupervisorTask(void *arg)
+{
+    auto *this_ = static_cast<WifiSupervisor *>(arg);
+    auto &station = WifiStation::GetInstance();
+    ProbeSchedule schedule(this_->config_.interval_ms, this_->config_.min_interval_ms, this_->config_.max_misses,
+                           this_->config_.recovery_timeout_ms);
+
+    while (this_->running_) {
+        // Sleep until the next probe, but wake up on every link change
+        wifi_link_event event;
+        if (xQueueReceive(this_->events_, &event, pdMS_TO_TICKS(schedule.GetIntervalMs())) == pdTRUE) {
+            int misses = schedule.GetMisses();
+            uint32_t since_recovery_ms = 0;
+            if (event.id == WIFI_LINK_EVENT_GOT_IP &&
+                schedule.OnGotIp(esp_timer_get_time(), &this_->last_recovery_ms_, &since_recovery_ms)) {
+                WIFI_EVENT_LOG(WIFI_LOG_RECOVERED, misses, this_->last_recovery_ms_, since_recovery_ms);
+                ESP_LOGI(TAG, "Link recovered %lu ms after the first missed probe", this_->last_recovery_ms_);
+            }
+            continue;
+        }
+        if (!this_->running_) {
+            continue;
+        }
+        if (schedule.IsRecovering()) {
+            if (schedule.OnRecoveryWait(esp_timer_get_time())) {
+                ESP_LOGW(TAG, "No IP %lu ms after reassociating, trying again", (unsigned long)this_->config_.recovery_timeout_ms);
+                station.Reassociate(this_->config_.failover);
+            }
+            continue;
+        }
+        if (station.GetStatus().state != WIFI_LINK_CONNECTED) {
+            continue;
+        }
+
+        bool ok = this_->Probe();
+        if (!ok) {
+            WIFI_EVENT_LOG(WIFI_LOG_PROBE_MISS, schedule.GetMisses() + 1, 0, 0);
+            ESP_LOGW(TAG, "Upstream probe missed (%d/%d)", schedule.GetMisses() + 1, this_->config_.max_misses);
+        }
+        if (schedule.OnProbe(ok, esp_timer_get_time())) {
+            ESP_LOGE(TAG, "Upstream is dead, %s", this_->config_.failover ? "failing over" : "reassociating");
+            this_->recovery_count_++;
+            station.Reassociate(this_->config_.failover);
+        }
+    }
+    xSemaphoreGive(this_->exited_);
+    vTaskDelete(NULL);
+}
+
+void WifiSupervisor::Start(const supervisor_cfg &config)
+{
+    if (running_) {
+        return;
+    }
+    config_ = config;
+    if (events_ == nullptr) {
+        events_ = xQueueCreate(4, sizeof(wifi_link_event));
+        exited_ = xSemaphoreCreateBinary();
+    }
+    // Events queued for the previous task mean nothing to this one, nor does
+    // the exit of a task that stopped itself
+    xQueueReset(events_);
+    xSemaphoreTake(exited_, 0);
+    listener_ = WifiStation::GetInstance().Subscribe(events_);
+    running_ = true;
+    xTaskCreate(&WifiSupervisor::SupervisorTask, "wifi_supervisor", 4096, this, 3, &task_);
+}
+
+void WifiSupervisor::Stop()
+{
+    if (!running_) {
+        return;
+    }
+    running_ = false;
+    WifiStation::GetInstance().Unsubscribe(listener_);
+    listener_ = -1;
+    // Wake the task so it sees running_ and exits. If the queue is full it
+    // wakes up anyway.
+    wifi_link_event event = {};
+    event.id = WIFI_LINK_EVENT_CONNECTED;
+    xQueueSend(events_, &event, 0);
+    // A Start() right after must not find the old task still draining the
+    // queue. The task cannot wait for itself.
+    if (xTaskGetCurrentTaskHandle() != task_) {
+        xSemaphoreTake(exited_, portMAX_DELAY);
+    }
+    task_ = nullptr;
+}